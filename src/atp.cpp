@@ -34,14 +34,19 @@ int atp_getfd(atp_socket * socket){
     return socket->sockfd;
 }
 
+void atp_refresh_local_addr(atp_socket * socket){
+    if(socket == nullptr) return;
+    socket->refresh_local_addr();
+}
+
 atp_socket * atp_create_socket(atp_context * context){
-    ATPSocket * socket = new ATPSocket(context);
+    ATPSocket * socket = context->new_socket();
     int sockfd = socket->init(AF_INET, SOCK_DGRAM, 0);
     // Now this socket is registered to context,
     // but it will not be able to locate until is connected.
     // Thus it will have its own (addr:port), and `register_to_look_up` will be called,
     // and the socket will be insert into `context->look_up`
-    context->sockets.push_back(socket);
+    context->add_socket(socket);
     return socket;
 }
 
@@ -70,6 +75,11 @@ ATP_PROC_RESULT atp_async_write(atp_socket * socket, void * buf, size_t length){
     return socket->write(buf, length);
 }
 
+ATP_PROC_RESULT atp_async_write_zc(atp_socket * socket, const void * buf, size_t length){
+    if(socket == nullptr) return ATP_PROC_ERROR;
+    return socket->write_zc(buf, length);
+}
+
 ATP_PROC_RESULT atp_send_packet(atp_socket * socket, void * buf, size_t length){
     if(socket == nullptr) return ATP_PROC_ERROR;
     return socket->write(buf, length);
@@ -80,32 +90,106 @@ ATP_PROC_RESULT atp_send_oob(atp_socket * socket, void * buf, size_t length, uin
     return socket->write_oob(buf, length, timeout);
 }
 
-ATP_PROC_RESULT atp_process_udp(atp_context * context, int sockfd, const char * buf, size_t len, const struct sockaddr * to, socklen_t tolen){
-    if(socket == nullptr) return ATP_PROC_ERROR;
-    ATPAddrHandle handle_to(to);
-    ATP_PROC_RESULT result = ATP_PROC_OK;
-    const ATPPacket * pkt = reinterpret_cast<const ATPPacket *>(buf);
+static ATPSocket * locate_socket(atp_context * context, int sockfd, const ATPAddrHandle & handle_to, const ATPPacket * pkt){
     // Whether the packet is to initialize a connection
     bool is_first = pkt->get_syn() && !(pkt->get_ack());
-    ATPSocket * socket = nullptr;
     if (is_first)
     {
         // find in listen
-        socket = context->find_socket_by_fd(handle_to, sockfd);
+        return context->find_socket_by_fd(handle_to, sockfd);
     } else{
         // find by packet
-        socket = context->find_socket_by_head(handle_to, pkt);
+        return context->find_socket_by_head(handle_to, pkt);
     }
+}
+
+ATP_PROC_RESULT atp_process_udp(atp_context * context, int sockfd, const char * buf, size_t len, const struct sockaddr * to, socklen_t tolen){
+    if(socket == nullptr) return ATP_PROC_ERROR;
+    ATPClockFreezer freezer(context);
+    ATPTxBatch batch;
+    ATPAddrHandle handle_to(to);
+    ATP_PROC_RESULT result = ATP_PROC_OK;
+    const ATPPacket * pkt = reinterpret_cast<const ATPPacket *>(buf);
+    ATPSocket * socket = locate_socket(context, sockfd, handle_to, pkt);
     if (socket == nullptr)
     {
         result = ATP_PROC_ERROR;
     }else{
         result = socket->process(handle_to, buf, len);
     }
+    if (context->burst_depth > 0)
+    {
+        // `atp_end_burst` will call `daily_routine`
+        return result;
+    }
     result = context->daily_routine();
     return result;
 }
 
+void atp_begin_burst(atp_context * context){
+    if(context == nullptr) return;
+    context->burst_depth++;
+    // Thawed by `atp_end_burst`
+    context->freeze_clock();
+    // Left by `atp_end_burst`, so packets sent during the burst are queued
+    tx_queue().enter();
+}
+
+ATP_PROC_RESULT atp_end_burst(atp_context * context){
+    if(context == nullptr) return ATP_PROC_ERROR;
+    assert(context->burst_depth > 0);
+    ATPClockFreezer freezer(context);
+    context->thaw_clock();
+    // Queued packets are sent when `batch` ends
+    ATPTxBatch batch;
+    tx_queue().leave();
+    if (--context->burst_depth > 0)
+    {
+        return ATP_PROC_OK;
+    }
+    context->flush_burst_acks();
+    return context->daily_routine();
+}
+
+ATP_PROC_RESULT atp_process_udp_gro(atp_context * context, int sockfd, const char * buf, size_t len, size_t segment_size, const struct sockaddr * to, socklen_t tolen){
+    if(context == nullptr) return ATP_PROC_ERROR;
+    if (segment_size == 0 || segment_size >= len)
+    {
+        return atp_process_udp(context, sockfd, buf, len, to, tolen);
+    }
+    // Sockets are not reaped during a burst, so `socket` stays valid for all segments
+    atp_begin_burst(context);
+    ATPAddrHandle handle_to(to);
+    ATPSocket * socket = nullptr;
+    for(size_t offset = 0; offset < len; offset += segment_size){
+        const ATPPacket * pkt = reinterpret_cast<const ATPPacket *>(buf + offset);
+        size_t seg_len = std::min(segment_size, len - offset);
+        // Segments share the source address, but sockets forked from a listener share the fd,
+        // so locate again only if a segment is not for the previous socket
+        bool is_first = pkt->get_syn() && !(pkt->get_ack());
+        if (socket == nullptr || is_first || pkt->peer_sock_id != socket->sock_id)
+        {
+            socket = locate_socket(context, sockfd, handle_to, pkt);
+        }
+        if (socket != nullptr)
+        {
+            // Segments are processed in place, like `atp_process_udp` does
+            socket->process(handle_to, buf + offset, seg_len);
+        }
+    }
+    return atp_end_burst(context);
+}
+
+ATP_PROC_RESULT atp_process_udp_batch(atp_context * context, const struct atp_datagram * datagrams, size_t n){
+    if(context == nullptr) return ATP_PROC_ERROR;
+    atp_begin_burst(context);
+    for(size_t i = 0; i < n; i++){
+        const atp_datagram & d = datagrams[i];
+        atp_process_udp_gro(context, d.sockfd, d.buf, d.len, d.segment_size, d.addr, d.addr_len);
+    }
+    return atp_end_burst(context);
+}
+
 ATP_PROC_RESULT atp_async_close(atp_socket * socket){
     if(socket == nullptr) return ATP_PROC_ERROR;
     #if defined (ATP_LOG_AT_DEBUG)
@@ -128,21 +212,57 @@ ATP_PROC_RESULT atp_eof(atp_socket * socket){
 
 ATP_PROC_RESULT atp_timer_event(atp_context * context, uint64_t interval){
     if(context == nullptr) return ATP_PROC_ERROR;
+    ATPClockFreezer freezer(context);
     ATP_PROC_RESULT result = context->daily_routine();
     return result;
 }
 
+int atp_next_timeout(atp_context * context){
+    int64_t after_us = atp_next_timeout_us(context);
+    if (after_us < 0)
+    {
+        return -1;
+    }
+    return static_cast<int>(std::min<int64_t>((after_us + 999) / 1000, INT32_MAX));
+}
+
+int64_t atp_next_timeout_us(atp_context * context){
+    if(context == nullptr) return -1;
+    return context->next_timeout_us();
+}
+
+int atp_get_timerfd(atp_context * context){
+    if(context == nullptr) return -1;
+    return context->get_timer_fd();
+}
+
 bool atp_destroyed(atp_socket * socket){
     if(socket == nullptr) return ATP_PROC_ERROR;
     return socket == nullptr ? true : socket->conn_state == CS_DESTROY;
 }
 
+atp_handle atp_get_handle(atp_socket * socket){
+    if(socket == nullptr) return 0;
+    return socket->handle;
+}
+
+atp_socket * atp_from_handle(atp_context * context, atp_handle handle){
+    if(context == nullptr) return nullptr;
+    return context->sockets.get(handle);
+}
+
+bool atp_handle_destroyed(atp_context * context, atp_handle handle){
+    ATPSocket * socket = atp_from_handle(context, handle);
+    // A socket in CS_DESTROY is waiting to be destroyed in `ATPContext::daily_routine`
+    return socket == nullptr ? true : socket->conn_state == CS_DESTROY;
+}
+
 void atp_set_long(atp_socket * socket, size_t option, size_t value){
     switch(option){
     case ATP_API_SACKOPT:
         break;
     case ATP_API_SOCKID:
-        socket->sock_id = value;
+        socket->context->claim_sock_id(socket, value);
         #if defined (ATP_LOG_AT_DEBUG)
             log_debug(socket, "Manually change sock_id to %u", socket->sock_id);
         #endif
@@ -150,6 +270,46 @@ void atp_set_long(atp_socket * socket, size_t option, size_t value){
     case ATP_API_REUSEPORT:
         socket->reuse_port_flag = value;
         break;
+    case ATP_API_RTO_MIN_US:
+        // The timer can't fire faster than a tick, and the bounds must not cross
+        if (value != 0 && (value < ATP_TIMER_TICK_US || value > socket->get_rto_max_us()))
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(socket, "Reject RTO min %u us, RTO max is %u us.", value, socket->get_rto_max_us());
+            #endif
+            break;
+        }
+        socket->rto_min_us = value;
+        socket->clamp_rto();
+        break;
+    case ATP_API_RTO_MAX_US:
+        if (value != 0 && value < std::max<uint64_t>(socket->get_rto_min_us(), ATP_TIMER_TICK_US))
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(socket, "Reject RTO max %u us, RTO min is %u us.", value, socket->get_rto_min_us());
+            #endif
+            break;
+        }
+        socket->rto_max_us = value;
+        socket->clamp_rto();
+        break;
+    case ATP_API_ACK_DELAYED_US:
+        socket->ack_delayed_us = value;
+        break;
+    case ATP_API_GSO:
+        socket->gso = value;
+        break;
+    case ATP_API_GRO:
+        socket->gro = value && socket->sockfd >= 0 && enable_udp_gro(socket->sockfd);
+        break;
+    case ATP_API_ZEROCOPY_MIN:
+        // MSG_ZEROCOPY is ignored by fds without SO_ZEROCOPY, then no completion would release the buffers
+        socket->zerocopy_min = (value > 0 && socket->sockfd >= 0 && zerocopy_registry().enable(socket->sockfd)) ? value : 0;
+        break;
+    case ATP_API_DEDICATED_FD:
+        // Dedicated fds can only be bound to the port if the listening fd allows it
+        socket->dedicated_fd = value && socket->sockfd >= 0 && enable_reuse_port(socket->sockfd);
+        break;
     }
 }
 
@@ -175,6 +335,26 @@ size_t atp_get_long(atp_socket * socket, size_t option){
         }else{
             return ATP_PROC_WAIT;
         }
+    case ATP_API_RTO_MIN_US:
+        return socket->get_rto_min_us();
+    case ATP_API_RTO_MAX_US:
+        return socket->get_rto_max_us();
+    case ATP_API_RTO_US:
+        return socket->rto_us;
+    case ATP_API_SRTT_US:
+        return socket->srtt_us;
+    case ATP_API_ACK_DELAYED_US:
+        return socket->ack_delayed_us;
+    case ATP_API_GSO:
+        return socket->gso;
+    case ATP_API_GRO:
+        return socket->gro;
+    case ATP_API_ZEROCOPY_MIN:
+        return socket->zerocopy_min;
+    case ATP_API_ZEROCOPY_PENDING:
+        return socket->sockfd >= 0 ? zerocopy_registry().pending(socket->sockfd) : 0;
+    case ATP_API_DEDICATED_FD:
+        return socket->dedicated_fd;
     }
 }
 
@@ -182,3 +362,101 @@ size_t atp_get_long(atp_socket * socket, size_t option){
 atp_result atp_destroy(atp_socket * socket){
     socket->destroy_hard();
 }
+
+atp_buffer * atp_buffer_retain(atp_callback_arguments * args){
+    if(args == nullptr) return nullptr;
+    if(args->buffer != nullptr && args->iov_count <= 1){
+        args->buffer->refs.fetch_add(1, std::memory_order_relaxed);
+        return args->buffer;
+    }
+    if(args->data == nullptr) return nullptr;
+    // `data` is not held by a buffer, for example a packet received in place, so make a copy.
+    // Packets referencing user memory are also copied, because the memory can be reused once the packet is ACKed.
+    const struct sockaddr * sa = args->callback_type == ATP_CALL_SENDTO ? args->addr : nullptr;
+    if(args->iov_count > 0){
+        return ATPBuffer::copy_from(args->iov, args->iov_count, sa);
+    }
+    struct iovec iov{args->data, args->length};
+    return ATPBuffer::copy_from(&iov, 1, sa);
+}
+
+void atp_buffer_release(atp_buffer * buffer){
+    if(buffer == nullptr) return;
+    if(buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        ATPBuffer::destroy(buffer);
+    }
+}
+
+char * atp_buffer_data(atp_buffer * buffer){
+    return buffer->packet()->data;
+}
+
+size_t atp_buffer_length(atp_buffer * buffer){
+    return buffer->packet()->length;
+}
+
+const struct sockaddr * atp_buffer_addr(atp_buffer * buffer){
+    return reinterpret_cast<const struct sockaddr *>(&(buffer->addr.sa));
+}
+
+void atp_set_context_long(atp_context * context, size_t option, size_t value){
+    if(context == nullptr) return;
+    switch(option){
+    case ATP_CONTEXT_API_CLOCK:
+        context->set_clock_source(value);
+        break;
+    case ATP_CONTEXT_API_VIRTUAL_MS:
+        context->set_virtual_us(value * 1000ull);
+        break;
+    case ATP_CONTEXT_API_VIRTUAL_US:
+        context->set_virtual_us(value);
+        break;
+    case ATP_CONTEXT_API_RTO_MIN_US:
+        if (value < ATP_TIMER_TICK_US || value > context->rto_max_us)
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(context, "Reject RTO min %u us, RTO max is %u us.", value, context->rto_max_us);
+            #endif
+            break;
+        }
+        context->rto_min_us = value;
+        for(ATPSocket * socket : context->sockets){
+            socket->clamp_rto();
+        }
+        break;
+    case ATP_CONTEXT_API_RTO_MAX_US:
+        if (value < context->rto_min_us)
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(context, "Reject RTO max %u us, RTO min is %u us.", value, context->rto_min_us);
+            #endif
+            break;
+        }
+        context->rto_max_us = value;
+        for(ATPSocket * socket : context->sockets){
+            socket->clamp_rto();
+        }
+        break;
+    }
+}
+
+size_t atp_get_context_long(atp_context * context, size_t option){
+    if(context == nullptr) return 0;
+    switch(option){
+    case ATP_CONTEXT_API_CLOCK:
+        return context->clock_source;
+    case ATP_CONTEXT_API_VIRTUAL_MS:
+        return context->virtual_us / 1000;
+    case ATP_CONTEXT_API_NOW_MS:
+        return context->now_ms();
+    case ATP_CONTEXT_API_VIRTUAL_US:
+        return context->virtual_us;
+    case ATP_CONTEXT_API_NOW_US:
+        return context->now_us();
+    case ATP_CONTEXT_API_RTO_MIN_US:
+        return context->rto_min_us;
+    case ATP_CONTEXT_API_RTO_MAX_US:
+        return context->rto_max_us;
+    }
+    return 0;
+}
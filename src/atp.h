@@ -37,7 +37,31 @@ enum atp_api_options{
     ATP_API_READABLE,
     ATP_API_EOF,
     ATP_API_REUSEPORT,
-    ATP_API_SENDINGSTATUS
+    ATP_API_SENDINGSTATUS,
+    ATP_API_RTO_MIN_US, // 0 to use the bound of the context, ignored if below the 100us timer tick or above the max
+    ATP_API_RTO_MAX_US, // 0 to use the bound of the context, ignored if below the min
+    ATP_API_RTO_US, // Read-only
+    ATP_API_SRTT_US, // Read-only
+    ATP_API_ACK_DELAYED_US, // 0 to disable delayed ACK
+    ATP_API_GSO, // Send packets of a write by UDP GSO, falls back if the kernel rejects it
+    ATP_API_GRO, // Enable UDP GRO on the fd, which must then be read by `recvfrom_gro`, 0 after set if not supported
+    ATP_API_ZEROCOPY_MIN, // Send packets of at least this many bytes with MSG_ZEROCOPY, 0 to disable, 0 after set if not supported
+    ATP_API_ZEROCOPY_PENDING, // Read-only, buffers on the fd held until the kernel completes their zero-copy sends
+    // Set on a listener before its fd is bound. Accepted connections get their own fd connected to the peer,
+    // forked ones open it by SO_REUSEPORT on the same port. A standalone context must poll `atp_getfd` of them, e.g. in ATP_CALL_ON_ACCEPT.
+    // A listener with SO_REUSEPORT forks even its first connection if ATP_CALL_ON_FORK is set, otherwise it accepts that one itself on its fd.
+    // 0 after set if SO_REUSEPORT is not supported
+    ATP_API_DEDICATED_FD
+};
+
+enum atp_context_api_options{
+    ATP_CONTEXT_API_CLOCK, // One of ATP_CLOCK_ENUM
+    ATP_CONTEXT_API_VIRTUAL_MS, // Current time of ATP_CLOCK_VIRTUAL in ms, must not go backwards
+    ATP_CONTEXT_API_NOW_MS, // Read-only, current time of the context in ms
+    ATP_CONTEXT_API_VIRTUAL_US,
+    ATP_CONTEXT_API_NOW_US, // Read-only
+    ATP_CONTEXT_API_RTO_MIN_US, // Default RTO bounds of sockets, ATP_RTO_MIN_US if not set, the same checks as ATP_API_RTO_MIN_US apply
+    ATP_CONTEXT_API_RTO_MAX_US // ATP_RTO_MAX_US if not set
 };
 
 atp_context * atp_create_context();
@@ -49,19 +73,61 @@ atp_result atp_listen(atp_socket * socket, uint16_t port);
 atp_result atp_async_connect(atp_socket * socket, const struct sockaddr * to, socklen_t tolen);
 atp_result atp_async_accept(atp_socket * socket, const struct sockaddr * to, socklen_t tolen);
 atp_result atp_async_write(atp_socket * socket, void * buf, size_t length);
+// Like `atp_async_write` but doesn't copy `buf`, which must stay unchanged until ATP_CALL_ON_SEND_COMPLETE is called with it.
+// Returns how many bytes are accepted, and ATP_CALL_ON_SEND_COMPLETE only covers these bytes.
+atp_result atp_async_write_zc(atp_socket * socket, const void * buf, size_t length);
 atp_result atp_send_packet(atp_socket * socket, void * buf, size_t length);
 atp_result atp_send_oob(atp_socket * socket, void * buf, size_t length, uint32_t timeout);
 atp_result atp_process_udp(atp_context * context, int sockfd, const char * buf, size_t len, const struct sockaddr * to, socklen_t tolen);
+// Process a datagram coalesced by UDP GRO, which holds packets of `segment_size` bytes(the last may be shorter).
+// All packets come from `to`, so the socket is located once for the datagram rather than once per packet.
+atp_result atp_process_udp_gro(atp_context * context, int sockfd, const char * buf, size_t len, size_t segment_size, const struct sockaddr * to, socklen_t tolen);
+// Process datagrams received together(such as by `recvmmsg`) in a burst, returns like `atp_timer_event`
+atp_result atp_process_udp_batch(atp_context * context, const struct atp_datagram * datagrams, size_t n);
+// Between `atp_begin_burst` and `atp_end_burst`, `atp_process_udp` doesn't run timers or reap destroyed sockets,
+// and immediate ACKs of a socket are coalesced into one. `atp_end_burst` does them all, and returns like `atp_timer_event`.
+// Datagrams sent during a burst are queued, and sent by `sendmmsg` in `atp_end_burst`, which must be called by the same thread.
+void atp_begin_burst(atp_context * context);
+atp_result atp_end_burst(atp_context * context);
+// Also releases buffers of completed `ATP_API_ZEROCOPY_MIN` sends, so call it when a fd sending them reports POLLERR,
+// which stays reported until the completions are read.
 atp_result atp_timer_event(atp_context * context, uint64_t interval);
+// Time(ms, rounded up) until `atp_timer_event` should be called, -1 if no socket is waiting for a timeout,
+// so it can be passed to `poll`/`epoll_wait` directly
+int atp_next_timeout(atp_context * context);
+// The same as `atp_next_timeout`, in us
+int64_t atp_next_timeout_us(atp_context * context);
+// Get a timerfd(non-blocking) which ATP keeps armed to the next timeout, created on first call and closed with the context.
+// When it is readable, read it and call `atp_timer_event`.
+int atp_get_timerfd(atp_context * context);
 atp_result atp_async_close(atp_socket * socket);
 atp_result atp_destroy(atp_socket * socket);
 void atp_set_callback(atp_socket * socket, int callback_type, atp_callback_func * proc);
 
 atp_result atp_eof(atp_socket * socket);
+// `socket` must not be destroyed by the context yet, use `atp_handle_destroyed` if not sure
 bool atp_destroyed(atp_socket * socket);
+// A handle can be checked safely even after the socket is destroyed and its memory is reused
+atp_handle atp_get_handle(atp_socket * socket);
+// Returns `nullptr` if the socket is destroyed
+atp_socket * atp_from_handle(atp_context * context, atp_handle handle);
+bool atp_handle_destroyed(atp_context * context, atp_handle handle);
 int atp_getfd(atp_socket * socket);
+// The local address is captured once the fd is bound, call this after binding the fd returned by `atp_getfd` again
+void atp_refresh_local_addr(atp_socket * socket);
 void atp_set_long(atp_socket * socket, size_t option, size_t value);
 size_t atp_get_long(atp_socket * socket, size_t option);
+void atp_set_context_long(atp_context * context, size_t option, size_t value);
+size_t atp_get_context_long(atp_context * context, size_t option);
+
+// Hold the datagram of a callback(usually `ATP_CALL_SENDTO`) after the callback returns, without copying it.
+// The buffer is immutable, and stays valid until `atp_buffer_release` is called, even if the packet is ACKed.
+atp_buffer * atp_buffer_retain(atp_callback_arguments * args);
+void atp_buffer_release(atp_buffer * buffer);
+char * atp_buffer_data(atp_buffer * buffer);
+size_t atp_buffer_length(atp_buffer * buffer);
+// Destination of the datagram, length is `sizeof(struct sockaddr_in)`
+const struct sockaddr * atp_buffer_addr(atp_buffer * buffer);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,195 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "atp_impl.h"
+#include <new>
+#include <typeinfo>
+
+static TPool<char> & slot_pool(){
+    // Slots overflowed from all arenas of this thread
+    static TPoolDepot<char> depot(ATP_SLOT_DEPOT_MAX, [](char * slot){ std::free(slot); });
+    thread_local TPool<char> pool(nullptr, [](char * slot){ std::free(slot); }
+        , ATP_SLOT_POOL_HIGH, ATP_SLOT_POOL_LOW, &depot);
+    return pool;
+}
+
+static TPool<ATPSocket> & socket_pool(){
+    // Only sockets of exact type `ATPSocket` are pooled, refer to `ATPContext::delete_socket`
+    static TPoolDepot<ATPSocket> depot(ATP_SOCKET_DEPOT_MAX, [](ATPSocket * socket){ delete socket; });
+    thread_local TPool<ATPSocket> pool(nullptr, [](ATPSocket * socket){ delete socket; }
+        , ATP_SOCKET_POOL_HIGH, ATP_SOCKET_POOL_LOW, &depot);
+    return pool;
+}
+
+OutgoingPacket * ATPPacketArena::fetch(size_t len){
+    char * slot = nullptr;
+    {
+        std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+        if(shared) lk.lock();
+        if(!cached.empty()){
+            slot = cached.back();
+            cached.pop_back();
+        }else{
+            slot = slot_pool().try_fetch();
+            if(slot == nullptr){
+                slot = (char *)std::malloc(ATP_PACKET_SLOT_SIZE);
+            }
+            slots_allocated++;
+        }
+        slots_in_use++;
+    }
+    ATPBuffer * buffer = new (slot) ATPBuffer();
+    // Held by the context
+    buffer->refs.store(1, std::memory_order_relaxed);
+    OutgoingPacket * pkt = new (buffer->packet()) OutgoingPacket{
+        0, 0, 0, 0, 0, 0, // observer, marked, selective_acked, ahead_handled, need_resend, spilled
+        0, 0, 0, // length, payload, option_len
+        0, // timestamp
+        0, 0, // transmissions, full_seq_nr
+        nullptr, 0, ATP_OPTION_HEADROOM, // data, capacity, headroom
+        nullptr, 0 // ext_data, ext_len
+    };
+    pkt->data = pkt->inline_data() + ATP_OPTION_HEADROOM;
+    pkt->capacity = ATP_PACKET_SLOT_DATA;
+    reserve(pkt, len);
+    return pkt;
+}
+
+void ATPPacketArena::reserve(OutgoingPacket * pkt, size_t len){
+    if(len <= pkt->capacity){
+        return;
+    }
+    // Grow out of the slot, at least double the capacity to make successive `add_data`s cheap
+    size_t new_capacity = std::max(len, pkt->capacity * 2);
+    if(pkt->spilled){
+        pkt->data = (char *)std::realloc(pkt->buffer(), pkt->headroom + new_capacity) + pkt->headroom;
+    }else{
+        char * spill = (char *)std::malloc(pkt->headroom + new_capacity);
+        std::memcpy(spill + pkt->headroom, pkt->data, pkt->inline_length());
+        pkt->data = spill + pkt->headroom;
+        pkt->spilled = 1;
+        spills++;
+    }
+    pkt->capacity = new_capacity;
+}
+
+void ATPPacketArena::release(OutgoingPacket * pkt){
+    if(pkt == nullptr || pkt->observer){
+        return;
+    }
+#if defined (ATP_LOG_AT_DEBUG)
+    if(pkt->length >= sizeof(ATPPacket))
+        fprintf(stderr, "Packet released with seq %u.\n", pkt->get_head()->seq_nr);
+    else
+        fprintf(stderr, "Packet released.\n");
+#endif
+    ATPBuffer * buffer = pkt->get_buffer();
+    if(buffer->refs.fetch_sub(1, std::memory_order_acq_rel) != 1){
+        // Still held by others(such as a deferred sender), the slot now belongs to them
+        std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+        if(shared) lk.lock();
+        slots_in_use--;
+        slots_allocated--;
+        return;
+    }
+    if(pkt->spilled){
+        std::free(pkt->buffer());
+    }
+    pkt->data = nullptr;
+    char * slot = reinterpret_cast<char *>(buffer);
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    slots_in_use--;
+    if(cached.size() < max_cached){
+        cached.push_back(slot);
+    }else{
+        slot_pool().release(slot);
+        slots_allocated--;
+    }
+}
+
+ATPBuffer * ATPBuffer::copy_from(const struct iovec * iov, int iov_count, const struct sockaddr * sa){
+    // The standalone buffer has the same layout as a slot, without headroom
+    size_t len = 0;
+    for(int i = 0; i < iov_count; i++){
+        len += iov[i].iov_len;
+    }
+    char * slot = (char *)std::malloc(sizeof(ATPBuffer) + sizeof(OutgoingPacket) + len);
+    ATPBuffer * buffer = new (slot) ATPBuffer();
+    buffer->refs.store(1, std::memory_order_relaxed);
+    if(sa != nullptr){
+        buffer->addr = ATPAddrHandle(sa);
+    }
+    OutgoingPacket * pkt = new (buffer->packet()) OutgoingPacket{
+        0, 0, 0, 0, 0, 0, // observer, marked, selective_acked, ahead_handled, need_resend, spilled
+        len, 0, 0, // length, payload, option_len
+        0, // timestamp
+        0, 0, // transmissions, full_seq_nr
+        nullptr, len, 0, // data, capacity, headroom
+        nullptr, 0 // ext_data, ext_len
+    };
+    pkt->data = pkt->inline_data();
+    size_t offset = 0;
+    for(int i = 0; i < iov_count; i++){
+        std::memcpy(pkt->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return buffer;
+}
+
+void ATPBuffer::destroy(ATPBuffer * buffer){
+    // The arena which allocated this slot may be already destroyed, so free the slot directly
+    OutgoingPacket * pkt = buffer->packet();
+    if(pkt->spilled){
+        std::free(pkt->buffer());
+    }
+    std::free(buffer);
+}
+
+void ATPPacketArena::clear(){
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    // Called at destruction of the context, the thread-local pool may be already destroyed
+    for(char * slot: cached){
+        std::free(slot);
+    }
+    slots_allocated -= cached.size();
+    cached.clear();
+}
+
+ATPSocket * ATPContext::new_socket(){
+    ATPSocket * socket = socket_pool().try_fetch();
+    if(socket == nullptr){
+        return new ATPSocket(this);
+    }
+    // Avoid constructing a socket, which costs a lot, such as `init_callbacks`
+    socket->reuse(this);
+    return socket;
+}
+
+void ATPContext::delete_socket(ATPSocket * socket){
+    if(typeid(*socket) != typeid(ATPSocket)){
+        // Derived sockets such as `ATPBlockedSocket` are not pooled
+        delete socket;
+        return;
+    }
+    // Return all packets to this context's arena now, the socket may be reused by another context
+    socket->clear();
+    socket_pool().release(socket);
+}
@@ -20,23 +20,392 @@
 #include "atp.h"
 #include "atp_impl.h"
 #include "udp_util.h"
+#include <linux/errqueue.h>
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+ATPZeroCopyRegistry & zerocopy_registry(){
+    static ATPZeroCopyRegistry registry;
+    return registry;
+}
+
+ATPZeroCopyRegistry::~ATPZeroCopyRegistry(){
+    for(auto & pr : fds){
+        for(Pending & pending : pr.second.pending){
+            atp_buffer_release(pending.buffer);
+        }
+    }
+}
+
+int ATPZeroCopyRegistry::send(int sockfd, struct mmsghdr * msgs, unsigned int n, ATPBuffer * const * buffers, size_t & held){
+    held = 0;
+    std::lock_guard<std::mutex> lock(mtx);
+    int r = sendmmsg(sockfd, msgs, n, MSG_ZEROCOPY);
+    if (r < 0 && errno == ENOBUFS)
+    {
+        // Pages of zero-copy sends are charged to the optmem limit of the socket, copy them until some are completed
+        return sendmmsg(sockfd, msgs, n, 0);
+    }
+    if (r <= 0)
+    {
+        return r;
+    }
+    // Every successful `sendmsg` with MSG_ZEROCOPY takes one number, even if its data is copied
+    Fd & fd = fds[sockfd];
+    for(int i = 0; i < r; i++){
+        for(size_t j = 0; j < msgs[i].msg_hdr.msg_iovlen; j++){
+            fd.pending.push_back(Pending{fd.next_id, buffers[held++]});
+        }
+        fd.next_id++;
+    }
+    sends += r;
+    total_pending.fetch_add(held, std::memory_order_relaxed);
+    return r;
+}
+
+size_t ATPZeroCopyRegistry::reap(int sockfd){
+    std::lock_guard<std::mutex> lock(mtx);
+    auto iter = fds.find(sockfd);
+    size_t released = 0;
+    // Nothing was sent with MSG_ZEROCOPY on the fd, so there's no completion to read
+    if (iter == fds.end())
+    {
+        return released;
+    }
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    while(true){
+        struct msghdr hdr;
+        std::memset(&hdr, 0, sizeof hdr);
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof control;
+        if (recvmsg(sockfd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            break;
+        }
+        for(struct cmsghdr * cm = CMSG_FIRSTHDR(&hdr); cm != nullptr; cm = CMSG_NXTHDR(&hdr, cm)){
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            struct sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cm), sizeof err);
+            // Other errors such as ICMP are dropped, like those never queued without IP_RECVERR
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+            {
+                continue;
+            }
+            // Sends numbered from `ee_info` to `ee_data` are completed, the range may wrap around
+            uint32_t lo = err.ee_info, hi = err.ee_data;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                copied += hi - lo + 1;
+            }
+            std::deque<Pending> & pending = iter->second.pending;
+            auto last = std::remove_if(pending.begin(), pending.end(), [&](const Pending & p){
+                if (p.id - lo > hi - lo)
+                {
+                    return false;
+                }
+                atp_buffer_release(p.buffer);
+                released++;
+                return true;
+            });
+            pending.erase(last, pending.end());
+        }
+    }
+    total_pending.fetch_sub(released, std::memory_order_relaxed);
+    return released;
+}
+
+void ATPZeroCopyRegistry::reap_all(){
+    if (total_pending.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    std::vector<int> sockfds;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for(auto & pr : fds){
+            if (!pr.second.pending.empty())
+            {
+                sockfds.push_back(pr.first);
+            }
+        }
+    }
+    for(int sockfd : sockfds){
+        reap(sockfd);
+    }
+}
+
+size_t ATPZeroCopyRegistry::pending(int sockfd){
+    std::lock_guard<std::mutex> lock(mtx);
+    auto iter = fds.find(sockfd);
+    return iter == fds.end() ? 0 : iter->second.pending.size();
+}
+
+bool ATPZeroCopyRegistry::enable(int sockfd){
+    if (!zerocopy_enabled(sockfd))
+    {
+        forget(sockfd);
+    }
+    return enable_zerocopy(sockfd);
+}
+
+void ATPZeroCopyRegistry::forget(int sockfd){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (fds.find(sockfd) == fds.end())
+        {
+            return;
+        }
+    }
+    reap(sockfd);
+    std::lock_guard<std::mutex> lock(mtx);
+    auto iter = fds.find(sockfd);
+    if (iter == fds.end())
+    {
+        return;
+    }
+    // Even without pending buffers, a new fd of the same number numbers its sends from 0
+    for(Pending & p : iter->second.pending){
+        atp_buffer_release(p.buffer);
+    }
+    total_pending.fetch_sub(iter->second.pending.size(), std::memory_order_relaxed);
+    fds.erase(iter);
+}
+
+ATPTxQueue & tx_queue(){
+    thread_local ATPTxQueue queue;
+    return queue;
+}
+
+void ATPTxQueue::push(int sockfd, const atp_callback_arguments * args){
+    Entry entry;
+    entry.sockfd = sockfd;
+    entry.buffer = nullptr;
+    entry.data = nullptr;
+    entry.offset = 0;
+    entry.length = args->length;
+    entry.addr = ATPAddrHandle(args->addr);
+    entry.gso = args->socket->gso;
+    entry.connected = args->socket->connected_fd;
+    // The kernel pins pages of a zero-copy datagram instead of copying them, so its buffer lives until the completion is reaped
+    entry.zerocopy = args->buffer != nullptr && args->socket->zerocopy_min > 0 && args->length >= args->socket->zerocopy_min;
+    if (args->buffer != nullptr && (entry.zerocopy || args->length > ATP_TX_COPY_MAX))
+    {
+        // Hold the buffer, so the packet can be ACKed and released before it is sent
+        args->buffer->refs.fetch_add(1, std::memory_order_relaxed);
+        entry.buffer = args->buffer;
+        entry.data = args->data;
+    } else {
+        // Small datagrams such as empty ACKs are usually released right after sent,
+        // copying them is cheaper than letting their slots leave the arena
+        entry.offset = copied.size();
+        copied.insert(copied.end(), args->data, args->data + args->length);
+    }
+    entries.push_back(entry);
+}
+
+bool ATPTxQueue::can_segment(const Entry & head, const Entry & entry, size_t segments, size_t bytes) const{
+    // All segments but the last one must be exactly `gso_size` bytes
+    return gso_supported && entry.gso && entry.sockfd == head.sockfd && entry.zerocopy == head.zerocopy
+        && entry.addr.sa.sin_addr.s_addr == head.addr.sa.sin_addr.s_addr && entry.addr.sa.sin_port == head.addr.sa.sin_port
+        && entry.length <= head.length
+        && segments < ATP_GSO_MAX_SEGMENTS && bytes + entry.length <= ATP_GSO_MAX_BYTES;
+}
+
+void ATPTxQueue::send_segments(int sockfd, struct msghdr & hdr){
+    // The kernel rejected UDP_SEGMENT, send segments one by one, and never try it again in this thread
+    gso_supported = false;
+    struct iovec * iov = hdr.msg_iov;
+    for(size_t i = 0; i < hdr.msg_iovlen; i++){
+        sendto(sockfd, iov[i].iov_base, iov[i].iov_len, 0, reinterpret_cast<const struct sockaddr *>(hdr.msg_name), hdr.msg_namelen);
+    }
+}
+
+void ATPTxQueue::flush(){
+    size_t total = entries.size();
+    if (total == 0)
+    {
+        return;
+    }
+    msgs.resize(total);
+    iovs.resize(total);
+    msg_entries.resize(total);
+    controls.resize(total * CMSG_SPACE(sizeof(uint16_t)));
+    // Datagrams of the same fd keep their order, and are sent by one `sendmmsg`
+    std::vector<bool> done(total, false);
+    std::vector<size_t> group;
+    for(size_t first = 0; first < total; first++){
+        if (done[first])
+        {
+            continue;
+        }
+        int sockfd = entries[first].sockfd;
+        group.clear();
+        for(size_t i = first; i < total; i++){
+            if (!done[i] && entries[i].sockfd == sockfd)
+            {
+                done[i] = true;
+                group.push_back(i);
+            }
+        }
+        size_t n = 0;
+        for(size_t k = 0; k < group.size(); n++){
+            Entry & head = entries[group[k]];
+            msg_entries[n] = k;
+            struct msghdr & hdr = msgs[n].msg_hdr;
+            std::memset(&hdr, 0, sizeof hdr);
+            if (!head.connected)
+            {
+                hdr.msg_name = &head.addr.sa;
+                hdr.msg_namelen = sizeof(struct sockaddr_in);
+            }
+            hdr.msg_iov = &iovs[k];
+            // Consecutive datagrams of the same size to the same peer are sent as one UDP GSO datagram
+            size_t segments = 0, bytes = 0;
+            do{
+                Entry & entry = entries[group[k]];
+                iovs[k].iov_base = const_cast<char *>(entry.buffer != nullptr ? entry.data : &copied[entry.offset]);
+                iovs[k].iov_len = entry.length;
+                segments++;
+                bytes += entry.length;
+                k++;
+                if (entry.length < head.length)
+                {
+                    // Only the last segment can be shorter
+                    break;
+                }
+            }while(head.gso && k < group.size() && can_segment(head, entries[group[k]], segments, bytes));
+            hdr.msg_iovlen = segments;
+            if (segments > 1)
+            {
+                hdr.msg_control = &controls[n * CMSG_SPACE(sizeof(uint16_t))];
+                hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr * cm = CMSG_FIRSTHDR(&hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = head.length;
+                std::memcpy(CMSG_DATA(cm), &gso_size, sizeof gso_size);
+                gso_sends++;
+            }
+        }
+        size_t sent = 0;
+        while(sent < n){
+            // Zero-copy messages are sent in runs by `zerocopy_registry()`, even with a `sender`, which may not report completions
+            bool zerocopy = entries[group[msg_entries[sent]]].zerocopy;
+            unsigned int count = 1;
+            while(sent + count < n && count < UIO_MAXIOV && entries[group[msg_entries[sent + count]]].zerocopy == zerocopy){
+                count++;
+            }
+            int r;
+            if (zerocopy)
+            {
+                zc_buffers.clear();
+                zc_entries.clear();
+                size_t end = sent + count < n ? msg_entries[sent + count] : group.size();
+                for(size_t k = msg_entries[sent]; k < end; k++){
+                    zc_buffers.push_back(entries[group[k]].buffer);
+                    zc_entries.push_back(group[k]);
+                }
+                size_t held;
+                r = zerocopy_registry().send(sockfd, &msgs[sent], count, zc_buffers.data(), held);
+                sendmmsg_calls++;
+                // The registry took over the references
+                for(size_t i = 0; i < held; i++){
+                    entries[zc_entries[i]].buffer = nullptr;
+                }
+            } else if (sender != nullptr)
+            {
+                r = sender->send_msgs(sockfd, &msgs[sent], count);
+            }else{
+                r = sendmmsg(sockfd, &msgs[sent], count, 0);
+                sendmmsg_calls++;
+            }
+            if (r <= 0)
+            {
+                #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
+                    fprintf(stderr, "Call sendmmsg on fd %d Failed with code %d.\n", sockfd, r);
+                #endif
+                struct msghdr & hdr = msgs[sent].msg_hdr;
+                if (hdr.msg_control != nullptr && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+                {
+                    send_segments(sockfd, hdr);
+                }
+                // Otherwise drop the datagram like a failed `sendto`, it will be re-sent if necessary
+                sent++;
+            } else {
+                for(int i = 0; i < r; i++){
+                    sendmmsg_datagrams += msgs[sent + i].msg_hdr.msg_iovlen;
+                }
+                sent += r;
+            }
+        }
+    }
+    if (sender != nullptr)
+    {
+        sender->commit();
+    }
+    for(Entry & entry : entries){
+        atp_buffer_release(entry.buffer);
+    }
+    entries.clear();
+    copied.clear();
+}
 
 ATP_PROC_RESULT normal_sendto(atp_callback_arguments * args){
     atp_socket * socket = args->socket;
-    const struct sockaddr * sa = args->addr;
+    // A connected fd needs no address, and the kernel skips the route lookup
+    const struct sockaddr * sa = socket->connected_fd ? nullptr : args->addr;
+    socklen_t sa_len = socket->connected_fd ? 0 : args->addr_len;
     ATPPacket * pkt = (ATPPacket *)args->data;
-    int n = sendto(socket->sockfd, args->data, args->length, 0, sa, args->addr_len);
-    if(n != args->length){
+    ssize_t n; size_t length = args->length;
+    ATPTxQueue & queue = tx_queue();
+    if(args->iov_count <= 1 && queue.batching()){
+        queue.push(socket->sockfd, args);
+        return ATP_PROC_OK;
+    }
+    if(args->iov_count <= 1 && args->buffer != nullptr && socket->zerocopy_min > 0 && args->length >= socket->zerocopy_min){
+        // Only the queue hands buffers to `zerocopy_registry()`
+        queue.push(socket->sockfd, args);
+        queue.flush();
+        return ATP_PROC_OK;
+    }
+    if(args->iov_count > 1){
+        // Keep the order of datagrams on this fd
+        queue.flush();
+        // The packet references user memory, refer to `atp_async_write_zc`
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof msg);
+        msg.msg_name = const_cast<struct sockaddr *>(sa);
+        msg.msg_namelen = sa_len;
+        msg.msg_iov = const_cast<struct iovec *>(args->iov);
+        msg.msg_iovlen = args->iov_count;
+        length = 0;
+        for(int i = 0; i < args->iov_count; i++){
+            length += args->iov[i].iov_len;
+        }
+        n = sendmsg(socket->sockfd, &msg, 0);
+    }else{
+        n = sendto(socket->sockfd, args->data, args->length, 0, sa, sa_len);
+    }
+    if(n != static_cast<ssize_t>(length)){
         #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
             // const sockaddr_in * sk = (const sockaddr_in *)sa;
-            ATPAddrHandle handle(sa);
+            ATPAddrHandle handle(args->addr);
             log_debug(socket, "Call sendto dest %s Failed with code %d.", handle.hash_code(), n);
         #endif
         return ATP_PROC_ERROR;
     }else{
         #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
             // const sockaddr_in * sk = (const sockaddr_in *)sa;
-            ATPAddrHandle handle(sa);
+            ATPAddrHandle handle(args->addr);
             log_debug(socket, "Call sendto dest %s, UDP Send %d bytes.", handle.hash_code(), n);
         #endif
         return ATP_PROC_OK;
@@ -89,5 +458,6 @@ void init_callbacks(ATPSocket * socket){
     socket->callbacks[ATP_CALL_ON_URG_TIMEOUT] = nullptr;
     socket->callbacks[ATP_CALL_BEFORE_REP_ACCEPT] = nullptr;
     socket->callbacks[ATP_CALL_ON_FORK] = nullptr;
+    socket->callbacks[ATP_CALL_ON_SEND_COMPLETE] = nullptr;
 }
 
@@ -21,12 +21,15 @@
 #include <netinet/in.h> // sockaddr
 #include <arpa/inet.h> // inet_pton
 #include <sys/socket.h> // socket
+#include <sys/uio.h> // iovec
 
 // ATPSocket wrap up the loop of connection open/close
 // They use socket->sys_cache rather than user's cache
 // because no user data is passed during such process
 // so 1024 bytes are enough, which is less than ATP_MSS_CEILING for ordinary ATP Packets
 #define ATP_SYSCACHE_MAX 64
+// A datagram coalesced by UDP GRO is at most 64KB
+#define ATP_GRO_CACHE_MAX 65536
 
 #if defined __GNUC__
     #define PACKED_ATTRIBUTE __attribute__((__packed__))
@@ -38,6 +41,15 @@
 extern "C" {
 #endif
 
+// Where `ATPContext::now_ms` reads time from
+enum ATP_CLOCK_ENUM {
+    ATP_CLOCK_MONOTONIC = 0,
+    // Faster, but only as precise as a scheduler tick(usually 1~4ms)
+    ATP_CLOCK_MONOTONIC_COARSE,
+    // Time only moves when user sets it, for simulation and benchmark
+    ATP_CLOCK_VIRTUAL
+};
+
 enum CONN_STATE_ENUM {
     // NOTICE Order is very important because we use `>=` to compare states.
     // Ref atp.cpp and atp_svc.cpp for more
@@ -89,6 +101,9 @@ enum {
 // typedef all interface struct to snakecase
 typedef struct ATPSocket atp_socket;
 typedef struct ATPContext atp_context;
+typedef struct ATPBuffer atp_buffer;
+// Refer to `atp_get_handle`
+typedef uint64_t atp_handle;
 typedef int ATP_PROC_RESULT;
 typedef ATP_PROC_RESULT atp_result;
 
@@ -113,6 +128,8 @@ enum ATP_CALLBACKTYPE_ENUM{
     ATP_CALL_ON_URG_TIMEOUT,
     ATP_CALL_BEFORE_REP_ACCEPT,
     ATP_CALL_ON_FORK,
+    // Memory passed to `atp_async_write_zc` can be reused, `error_code` is not 0 if not all data are ACKed
+    ATP_CALL_ON_SEND_COMPLETE,
 
     ATP_CALLBACK_SIZE, // must be the last
 };
@@ -131,6 +148,14 @@ struct atp_callback_arguments {
     union {
         socklen_t addr_len;
     };
+    // The reference-counted buffer holding `data`, `nullptr` if `data` is not held by a buffer.
+    // Refer to `atp_buffer_retain`
+    atp_buffer * buffer;
+    // For ATP_CALL_SENDTO, the whole datagram, valid only during the callback.
+    // A packet sent by `atp_async_write_zc` references user memory, then `data` and `length` only cover
+    // the head and options, and `iov_count` > 1.
+    const struct iovec * iov;
+    int iov_count;
 };
 
 typedef atp_result atp_callback_func(atp_callback_arguments *);
@@ -140,6 +165,17 @@ struct atp_iovec {
     size_t iov_len;
 };
 
+// A datagram received from UDP, refer to `atp_process_udp_batch`
+struct atp_datagram {
+    int sockfd;
+    const char * buf;
+    size_t len;
+    const struct sockaddr * addr;
+    socklen_t addr_len;
+    // Size of the packets coalesced by UDP GRO into `buf`, 0 if `buf` is a single packet
+    size_t segment_size;
+};
+
 struct PACKED_ATTRIBUTE CATPPacket{
     // ATP packet layout, trivial
     // seq_nr and ack_nr are now packet-wise rather than byte-wise
@@ -174,6 +210,13 @@ static const size_t ATP_MSS_FLOOR = INTERNET_MTU - IPV4_HEADER_SIZE - UDP_HEADER
 #define ATP_RTO_MIN 1000
 // TCP recommends 120000
 #define ATP_RTO_MAX 12000
+// Timing engine works in microseconds, the bounds above are defaults of every context,
+// and can be changed by ATP_CONTEXT_API_RTO_MIN_US/ATP_CONTEXT_API_RTO_MAX_US, or by ATP_API_RTO_MIN_US/ATP_API_RTO_MAX_US per socket.
+#define ATP_RTO_MIN_US (ATP_RTO_MIN * 1000ull)
+#define ATP_RTO_MAX_US (ATP_RTO_MAX * 1000ull)
+// RTO before the first RTT sample
+#define ATP_RTO_INITIAL_US 2000000ull
+#define ATP_ACK_DELAYED_US 200000ull
 // Time event interval is close to ATP_RTO_MIN may cause re-sending
 #define ATP_TIMEEVENT_INTERVAL_MAX 500
 
@@ -19,6 +19,7 @@
 */
 #include "atp_impl.h"
 #include <sstream>
+#include <ctime>
 
 const char * CONN_STATE_STRS []= {
     "CS_UNINITIALIZED",
@@ -89,53 +90,277 @@ std::string OutgoingPacket::get_flags_str(OutgoingPacket const * out_pkt) {
 }
 
 void ATPContext::clear(){
-    for(ATPSocket * socket : sockets){
-        delete (socket);
-        socket = nullptr;
-    }
+    std::vector<ATPSocket *> leaving(sockets.begin(), sockets.end());
     sockets.clear();
-    look_up.clear();
     listen_sockets.clear();
+    listen_fds.clear();
+    fd_ports.clear();
+    // A shared fd is released with the last socket using it
+    for(ATPSocket * socket : leaving){
+        release_socket_fd(socket);
+        delete_socket(socket);
+    }
+    fd_users.clear();
+    // Nodes of deleted sockets are dropped with the wheel
+    timer_wheel.init(now_us() / ATP_TIMER_TICK_US);
+    memset(sock_id_bitmap, 0, sizeof sock_id_bitmap);
+    for(ATPSocket ** & page : sock_id_pages){
+        delete [] page;
+        page = nullptr;
+    }
+    look_up.clear();
+    burst_acks.clear();
+}
+static uint64_t read_clock(int source, uint64_t virtual_us){
+    struct timespec ts;
+    switch(source){
+    case ATP_CLOCK_VIRTUAL:
+        return virtual_us;
+    case ATP_CLOCK_MONOTONIC_COARSE:
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        break;
+    default:
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        break;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Contexts frozen by this thread, innermost last
+struct ATPClockFrame {
+    ATPContext * context;
+    int depth;
+    uint64_t us;
+};
+static thread_local std::vector<ATPClockFrame> clock_frames;
+
+static ATPClockFrame * find_clock_frame(ATPContext * context){
+    for(ATPClockFrame & frame : clock_frames){
+        if (frame.context == context)
+        {
+            return &frame;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t ATPContext::now_us(){
+    ATPClockFrame * frame = find_clock_frame(this);
+    if (frame != nullptr)
+    {
+        return frame->us;
+    }
+    // Coarse clock may lag behind the fine one a little, and other threads may have read a later time, never go backwards
+    uint64_t now = read_clock(clock_source, virtual_us) + clock_offset;
+    uint64_t last = last_us.load(std::memory_order_relaxed);
+    while(last < now && !last_us.compare_exchange_weak(last, now, std::memory_order_relaxed)){
+    }
+    return std::max(last, now);
+}
+
+void ATPContext::set_clock_source(int source){
+    uint64_t now = now_us();
+    clock_source = source;
+    // Continue from `now` with the new source
+    clock_offset = static_cast<int64_t>(now) - static_cast<int64_t>(read_clock(clock_source, virtual_us));
+}
+
+void ATPContext::set_virtual_us(uint64_t us){
+    virtual_us = us;
+    if (find_clock_frame(this) == nullptr)
+    {
+        now_us();
+    }
 }
+
+void ATPContext::freeze_clock(){
+    ATPClockFrame * frame = find_clock_frame(this);
+    if (frame == nullptr)
+    {
+        clock_frames.push_back(ATPClockFrame{this, 0, now_us()});
+        frame = &clock_frames.back();
+    }
+    frame->depth++;
+}
+
+void ATPContext::thaw_clock(){
+    ATPClockFrame * frame = find_clock_frame(this);
+    assert(frame != nullptr && frame->depth > 0);
+    if (--frame->depth == 0)
+    {
+        clock_frames.erase(clock_frames.begin() + (frame - clock_frames.data()));
+    }
+}
+
 void ATPContext::init(){
     clear();
-    start_ms = get_current_ms();
-    std::srand(start_ms);
+    start_ms = now_ms();
+    std::srand(get_current_ms());
+    timer_wheel.init(now_us() / ATP_TIMER_TICK_US);
+    // Salt the first sock_id, so different contexts don't start with the same sock_id
+    sock_id_cursor = std::rand();
 }
 
-uint16_t ATPContext::new_sock_id(){
+uint16_t ATPContext::new_sock_id(ATPSocket * owner){
+    // Find the first free bit from `sock_id_cursor`, checking 64 sock_ids at a time
+    for(size_t n = 0; n <= 65536 / 64; n++){
+        uint16_t base = sock_id_cursor & ~static_cast<uint16_t>(63);
+        uint64_t word = sock_id_bitmap[base >> 6];
+        // Ignore bits before the cursor, and sock_id 0
+        word |= (static_cast<uint64_t>(1) << (sock_id_cursor & 63)) - 1;
+        word |= sock_id_foreign[(base >> 6) & 3];
+        if (base == 0)
+        {
+            word |= 1;
+        }
+        if (word != ~static_cast<uint64_t>(0))
+        {
+            uint16_t s = base + __builtin_ctzll(~word);
+            sock_id_bitmap[s >> 6] |= static_cast<uint64_t>(1) << (s & 63);
+            sock_id_cursor = s + 1;
+            ATPSocket ** & page = sock_id_pages[s >> 8];
+            if (page == nullptr)
+            {
+                page = new ATPSocket * [256]();
+            }
+            page[s & 0xff] = owner;
+            return s;
+        }
+        sock_id_cursor = base + 64;
+    }
+    // All 65535 sock_ids are in use, fall back to a random one shared with another socket.
+    // They can still be told apart by their peer address in `look_up`.
+    #if defined (ATP_LOG_AT_DEBUG)
+        log_debug(this, "Run out of sock_id.");
+    #endif
     uint16_t s = 0;
-    while(s == 0){
+    while(s == 0 || (s & 0xff) % sock_id_shards != sock_id_shard){
         s = std::rand();
     }
     return s;
 }
 
+void ATPContext::set_sock_id_shard(uint16_t shard, uint16_t shards){
+    sock_id_shard = shard;
+    sock_id_shards = std::max<uint16_t>(shards, 1);
+    for(uint16_t low = 0; low < 256; low++){
+        uint64_t bit = static_cast<uint64_t>(1) << (low & 63);
+        if (low % sock_id_shards == sock_id_shard)
+        {
+            sock_id_foreign[low >> 6] &= ~bit;
+        }else{
+            sock_id_foreign[low >> 6] |= bit;
+        }
+    }
+}
+
+void ATPContext::release_sock_id(ATPSocket * owner){
+    uint16_t s = owner->sock_id;
+    ATPSocket ** page = sock_id_pages[s >> 8];
+    if (s == 0 || page == nullptr || page[s & 0xff] != owner)
+    {
+        return;
+    }
+    page[s & 0xff] = nullptr;
+    sock_id_bitmap[s >> 6] &= ~(static_cast<uint64_t>(1) << (s & 63));
+}
+
+void ATPContext::claim_sock_id(ATPSocket * owner, uint16_t s){
+    release_sock_id(owner);
+    owner->sock_id = s;
+    if (s == 0)
+    {
+        return;
+    }
+    ATPSocket ** & page = sock_id_pages[s >> 8];
+    if (page == nullptr)
+    {
+        page = new ATPSocket * [256]();
+    }
+    // If it is used by another socket, we take it over, the other one can still be located by `look_up`
+    page[s & 0xff] = owner;
+    sock_id_bitmap[s >> 6] |= static_cast<uint64_t>(1) << (s & 63);
+}
+
 void ATPContext::destroy_socket(ATPSocket * socket){
     #if defined (ATP_LOG_AT_DEBUG)
         log_debug(socket, "Context are actually destroying me. Goodbye. There are %u sockets left in the context including me", sockets.size());
     #endif
     // Try to remove from socket
-    auto iter = std::find(sockets.begin(), sockets.end(), socket);
-    sockets.erase(iter);
+    sockets.erase(socket->handle);
+    socket->handle = 0;
+    timer_wheel.cancel(&socket->timer_node);
+    release_sock_id(socket);
     // Try to remove from look_up
-    auto map_iter1 = look_up.find(socket->hash_code());
-    if (map_iter1 != look_up.end())
+    // Only erase the entry when it is still owned by this socket
+    uint64_t key = ATPSocket::make_look_up_key(socket->sock_id, socket->dest_addr);
+    if (look_up.find(key) == socket)
     {
-        look_up.erase(map_iter1);
+        look_up.erase(key);
     }
+    // The fd is released first, so the listener's fd is no longer counted in use when it stops listening
+    uint16_t host_port = socket->get_local_addr().host_port();
+    release_socket_fd(socket);
     // Try to remove from listen
-    deregister_listen_port(socket->get_local_addr().host_port());
-    delete socket;
+    deregister_listen_port(socket, host_port);
+    delete_socket(socket);
+}
+
+void ATPContext::release_socket_fd(ATPSocket * socket){
+    remove_fd_user(socket->sockfd);
+    if (!socket->owns_fd)
+    {
+        // The user closes the fd, and a new fd of the same number numbers its zero-copy sends from 0
+        if (socket->sockfd >= 0 && !fd_in_use(socket->sockfd))
+        {
+            zerocopy_registry().forget(socket->sockfd);
+            index_fd_port(socket->sockfd, 0);
+        }
+        return;
+    }
+    // Queued datagrams refer to the fd by number
+    tx_queue().flush();
+    detach_dedicated_fd(socket->sockfd);
+    zerocopy_registry().forget(socket->sockfd);
+    index_fd_port(socket->sockfd, 0);
+    close(socket->sockfd);
+    socket->sockfd = -1;
+    socket->owns_fd = false;
 }
     
+void ATPContext::flush_burst_acks(){
+    for(ATPSocket * socket : burst_acks){
+        // The ACK may be sent with other packets already, or the socket is reset
+        if (!socket->burst_ack_pending)
+        {
+            continue;
+        }
+        socket->burst_ack_pending = false;
+        OutgoingPacket * out_pkt = socket->basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
+        #if defined (ATP_LOG_AT_DEBUG)
+            log_debug(socket, "ACK packet sent at the end of burst. seq:%u.", out_pkt->get_head()->seq_nr);
+        #endif
+        socket->send_packet(out_pkt);
+    }
+    burst_acks.clear();
+}
+
 ATP_PROC_RESULT ATPContext::daily_routine(){
     // notify all exsiting sockets
     // trigger1: once a message arrived
     // trigger2: timeout
     ATP_PROC_RESULT result = ATP_PROC_OK;
-    for(ATPSocket * socket: this->sockets){
+    // Release buffers the kernel finished sending with MSG_ZEROCOPY
+    zerocopy_registry().reap_all();
+    // Packets re-sent by all sockets are sent together
+    ATPTxBatch batch;
+    // Only sockets with due timeouts are checked
+    due_sockets.clear();
+    timer_wheel.advance(now_us() / ATP_TIMER_TICK_US, due_sockets);
+    for(ATPSocket * socket: due_sockets){
         ATP_PROC_RESULT sub_result = socket->check_timeout();
+        // Watch the next timeout
+        socket->arm_timer();
         if (sub_result == ATP_PROC_ERROR)
         {
             result = ATP_PROC_ERROR;
@@ -157,6 +382,7 @@ ATP_PROC_RESULT ATPContext::daily_routine(){
         this->destroy_socket(socket);
     }
     destroyed_sockets.clear();
+    update_timer_fd();
     if (this->finished())
     {
         // There's no sockets active
@@ -173,6 +399,41 @@ ATP_PROC_RESULT ATPContext::daily_routine(){
     }
 }
 
+void ATPContext::add_fd_user(int sockfd){
+    if (sockfd < 0)
+    {
+        return;
+    }
+    if (fd_users.size() <= static_cast<size_t>(sockfd))
+    {
+        fd_users.resize(sockfd + 1, 0);
+    }
+    fd_users[sockfd]++;
+}
+
+void ATPContext::remove_fd_user(int sockfd){
+    if (fd_in_use(sockfd))
+    {
+        fd_users[sockfd]--;
+    }
+}
+
+void ATPContext::index_fd_port(int sockfd, uint16_t host_port){
+    if (sockfd < 0)
+    {
+        return;
+    }
+    if (fd_ports.size() <= static_cast<size_t>(sockfd))
+    {
+        if (host_port == 0)
+        {
+            return;
+        }
+        fd_ports.resize(sockfd + 1, 0);
+    }
+    fd_ports[sockfd] = host_port;
+}
+
 ATPSocket * ATPContext::find_socket_by_fd(const ATPAddrHandle & handle_to, int sockfd){
     // When a packet is comming with SYN mark, we should find its dest socket in listen queue by sockfd
     if (handle_to.host_port() == 0 && handle_to.host_addr() == 0)
@@ -183,12 +444,19 @@ ATPSocket * ATPContext::find_socket_by_fd(const ATPAddrHandle & handle_to, int s
         #endif
         return nullptr;
     }
-    sockaddr_in my_sock; socklen_t my_sock_len = sizeof(my_sock);
-    // get `sockaddr_in` from `sockfd`
-    getsockname(sockfd, reinterpret_cast<SA *>(&my_sock), &my_sock_len);
-    ATPAddrHandle handle_me(reinterpret_cast<SA *>(&my_sock));
+    // Fast path: the fd is owned by a listening socket
+    if (sockfd >= 0 && static_cast<size_t>(sockfd) < this->listen_fds.size() && this->listen_fds[sockfd] != nullptr)
+    {
+        return this->listen_fds[sockfd];
+    }
+    // Otherwise the fd is not the one we listen on, e.g. a dedicated fd, locate the listener by the port it's bound to
+    uint16_t host_port = 0;
+    if (sockfd >= 0 && static_cast<size_t>(sockfd) < this->fd_ports.size())
+    {
+        host_port = this->fd_ports[sockfd];
+    }
 
-    std::map<uint16_t, ATPSocket*>::iterator iter = this->listen_sockets.find(handle_me.host_port());
+    std::map<uint16_t, ATPSocket*>::iterator iter = host_port == 0 ? this->listen_sockets.end() : this->listen_sockets.find(host_port);
     if(iter != this->listen_sockets.end()){
         ATPSocket * socket = iter->second;
         return socket;
@@ -201,7 +469,7 @@ ATPSocket * ATPContext::find_socket_by_fd(const ATPAddrHandle & handle_to, int s
                 ext += ' ';
             }
             log_debug(this, "Can't locate socket by fd %u, port: %u, the exsiting %u listening sockets are: %s\n"
-                , sockfd, handle_me.host_port(), this->listen_sockets.size(), tabber(ext).c_str());
+                , sockfd, host_port, this->listen_sockets.size(), tabber(ext).c_str());
         #endif
         return nullptr;
     }
@@ -218,22 +486,24 @@ ATPSocket * ATPContext::find_socket_by_head(const ATPAddrHandle & handle_to, con
         #endif
         return nullptr;
     }
-    std::string hashing = std::string(ATPSocket::make_hash_code(pkt->peer_sock_id, handle_to));
-    std::map<std::string, ATPSocket*>::iterator iter = this->look_up.find(hashing);
-    if(iter != this->look_up.end()){
-        ATPSocket * socket = iter->second;
+    // `peer_sock_id` is our sock_id, which locates the socket directly in most cases
+    ATPSocket * socket = find_socket_by_sock_id(pkt->peer_sock_id);
+    if(socket != nullptr && socket->dest_addr == handle_to){
+        return socket;
+    }
+    socket = this->look_up.find(ATPSocket::make_look_up_key(pkt->peer_sock_id, handle_to));
+    if(socket != nullptr){
         return socket;
     } else{
         // there's no such socket
         #if defined (ATP_LOG_AT_DEBUG)
             std::string ext;
-            for(std::map<std::string, ATPSocket*>::value_type & pr : this->look_up)
-            {
-                ext += pr.first;
+            this->look_up.for_each([&ext](uint64_t key, ATPSocket * s){
+                ext += s->hash_code();
                 ext += ' ';
-            }
+            });
             log_debug(this, "Can't locate socket by packet head:%s, the exsiting %u sockets are: %s\n"
-                , hashing.c_str(), this->look_up.size(), tabber(ext).c_str());
+                , ATPSocket::make_hash_code(pkt->peer_sock_id, handle_to), this->look_up.size(), tabber(ext).c_str());
         #endif
         return nullptr;
     }
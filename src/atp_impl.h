@@ -31,7 +31,11 @@
 #include <algorithm>
 #include <functional>
 #include <queue>
+#include <deque>
 #include <type_traits>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
 
 #define LOGLEVEL_FATAL 1
 #define LOGLEVEL_NOTE 2
@@ -255,36 +259,67 @@ struct PACKED_ATTRIBUTE TimeDelayOption {
     uint64_t reply_timestamp;
 };
 
-struct OutgoingPacket {
-    ~OutgoingPacket() {
-        if (!observer)
-            destroy();
+struct ATPPacketArena;
+struct OutgoingPacket;
+
+// Every arena slot begins with an `ATPBuffer`, which is the reference-counted handle of the packet in the slot.
+// The context holds one reference until the packet is ACKed or dropped, and deferred senders can hold more
+// by `atp_buffer_retain`. Data of a packet never change after it is sent, so all holders can share it without copying.
+// Whoever drops the last reference frees the slot.
+struct alignas(16) ATPBuffer {
+    std::atomic<uint32_t> refs;
+    // Destination of the datagram, copied when the packet is sent for the first time
+    ATPAddrHandle addr;
+
+    OutgoingPacket * packet() {
+        return reinterpret_cast<OutgoingPacket *>(this + 1);
     }
+    // Copy data which are not in a slot, such as a packet received in place, or a packet referencing user memory
+    static ATPBuffer * copy_from(const struct iovec * iov, int iov_count, const struct sockaddr * sa);
+    // Free a slot whose last reference is dropped outside of its arena
+    static void destroy(ATPBuffer * buffer);
+};
 
+struct OutgoingPacket {
     // Don't directly call `new OutgoingPacket` to for a new OutgoingPacket. Because:
     // 1. In former/later version, some fields should be initialized with non-zero value.
     // 2. `OutgoingPacket` should be aggregate constructible.
-    uint8_t observer: 1, marked: 1, selective_acked: 1, ahead_handled: 1, need_resend: 1;
+    // 3. Every `OutgoingPacket` lives in a slot of `ATPContext::packet_arena`, use `fetch`/`release` of the arena.
+    // `observer` packets do not own their data, so the arena will not release them.
+    // `spilled` packets have grown out of their slot, and their data is allocated by malloc/free.
+    uint8_t observer: 1, marked: 1, selective_acked: 1, ahead_handled: 1, need_resend: 1, spilled: 1;
     size_t length = 0; // length of the whole
     size_t payload = 0;
     size_t option_len = 0;
     uint64_t timestamp; // microseconds
     uint32_t transmissions = 0; // total number of transmissions
     uint32_t full_seq_nr;
-    // IMPORTANT: `data` is allocated by malloc/free, not new/delete
-    char * data; // = head + data
-
-    void destroy() {
-        // TODO now manually managing memory, swith to smart pointers later
+    char * data; // = head + options + data
+    size_t capacity = 0; // bytes can be hold by `data` without growing
+    // Bytes reserved before `data`. `add_option` moves the head backward into the headroom
+    // rather than moving user data forward.
+    size_t headroom = 0;
+    // User data referenced rather than copied, it follows `data` on wire. Refer to `ATPSocket::write_zc`.
+    // `length` and `payload` count `ext_len`.
+    const char * ext_data = nullptr;
+    size_t ext_len = 0;
+
+    size_t inline_length() const {
+        // Bytes actually in `data`
+        return length - ext_len;
+    }
 
-#if defined (ATP_LOG_AT_DEBUG)
-        if (data)
-            fprintf(stderr, "Packet destructed with seq %u.\n", get_head()->seq_nr);
-        else
-            fprintf(stderr, "Packet destructed.\n");
-#endif
-        std::free(data);
-        data = nullptr;
+    char * inline_data() {
+        // The inline data region follows the packet in its arena slot
+        return reinterpret_cast<char *>(this + 1);
+    }
+    ATPBuffer * get_buffer() {
+        // Only valid for packets in arena slots, whose `observer` is not set
+        return reinterpret_cast<ATPBuffer *>(this) - 1;
+    }
+    char * buffer() {
+        // Where the memory holding `data` begins
+        return data - headroom;
     }
     char * find_option(uint8_t opt_kind) {
         char * p = data + sizeof(ATPPacket);
@@ -375,13 +410,108 @@ template<class T, typename... Args>
 struct is_braces_constructible : decltype(_is_braces_constructible_test<T, Args...>(0)) {};
 
 static_assert(is_braces_constructible<OutgoingPacket,
-              uint8_t, uint8_t, uint8_t, uint8_t, uint8_t,
+              uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t,
               size_t, size_t, size_t,
               uint64_t,
               uint32_t, uint32_t,
-              char *>::value,
+              char *, size_t, size_t,
+              const char *, size_t>::value,
               "OutgoingPacket is not trivially constructible");
 
+// A slot holds an `OutgoingPacket` together with an ATPPacket of `ATP_MSS_CEILING` payload,
+// which is the upper bound of `current_mss`, so most packets never allocate memory for their data.
+// Packets grow larger than that(URG packets, or packets received from a peer with greater MTU) spill onto heap.
+static const size_t ATP_PACKET_SLOT_DATA = sizeof(CATPPacket) + ATP_MSS_CEILING;
+// Options(SACK, timestamp, ...) are attached after user data are filled, so every slot reserves room before the head.
+// Options larger than the remaining headroom fall back to moving user data.
+static const size_t ATP_OPTION_HEADROOM = 128;
+static const size_t ATP_PACKET_SLOT_SIZE = sizeof(ATPBuffer) + sizeof(OutgoingPacket) + ATP_OPTION_HEADROOM + ATP_PACKET_SLOT_DATA;
+// By default a context keeps at most this number of free slots
+#define ATP_ARENA_MAX_CACHED 1024
+// Free slots overflowed from arenas are kept by a per-thread pool, and then by a global depot
+#define ATP_SLOT_POOL_HIGH 256
+#define ATP_SLOT_POOL_LOW 128
+#define ATP_SLOT_DEPOT_MAX 4096
+// The same for destroyed sockets, refer to `ATPContext::new_socket`
+#define ATP_SOCKET_POOL_HIGH 64
+#define ATP_SOCKET_POOL_LOW 32
+#define ATP_SOCKET_DEPOT_MAX 1024
+
+struct ATPPacketArena {
+    // Get a packet whose `data` can hold at least `len` bytes
+    OutgoingPacket * fetch(size_t len);
+    // Return a packet on ACK or drop, the packet can't be used any more
+    void release(OutgoingPacket * pkt);
+    // Make sure `pkt->data` can hold at least `len` bytes, existing data and headroom are preserved
+    void reserve(OutgoingPacket * pkt, size_t len);
+    void clear();
+
+    ~ATPPacketArena() {
+        clear();
+    }
+
+    // If the context is accessed by more than one thread, such as `ATPContextServer`, set `shared`
+    bool shared = false;
+    size_t max_cached = ATP_ARENA_MAX_CACHED;
+    // Statistics
+    size_t slots_allocated = 0; // slots currently allocated from heap, including cached ones
+    size_t slots_in_use = 0;
+    size_t spills = 0;
+protected:
+    std::vector<char *> cached;
+    std::mutex mtx;
+};
+
+// A deadline of a socket, linked into a slot of `ATPTimerWheel`
+struct ATPTimerNode {
+    ATPTimerNode * prev = nullptr;
+    ATPTimerNode * next = nullptr;
+    uint64_t expire = 0; // tick
+    ATPSocket * owner = nullptr;
+    bool linked() const {
+        return next != nullptr;
+    }
+};
+
+// Deadlines are rounded up to ticks
+#define ATP_TIMER_TICK_US 100
+#define ATP_TIMER_WHEEL_LEVELS 4
+#define ATP_TIMER_WHEEL_BITS 8
+#define ATP_TIMER_WHEEL_SLOTS (1 << ATP_TIMER_WHEEL_BITS)
+
+// A hierarchical timing wheel whose tick is ATP_TIMER_TICK_US.
+// Level l holds deadlines which are at most 256^(l+1) ticks later, and each slot of it covers 256^l ticks.
+// When the lower level wraps around, the slot of the upper level is cascaded down,
+// so a tick only touches deadlines which are due, and deadlines which are cascaded.
+struct ATPTimerWheel {
+    ATPTimerWheel();
+    // Reset the wheel to `now`, all nodes are dropped without being unlinked
+    void init(uint64_t now);
+    // Node is due when `advance` is called with a `now` not less than `expire`, re-schedule a linked node moves it
+    void schedule(ATPTimerNode * node, uint64_t expire);
+    void cancel(ATPTimerNode * node);
+    // Unlink all due nodes, and push their owners to `due`
+    void advance(uint64_t now, std::vector<ATPSocket *> & due);
+    // Get the earliest `expire` of all linked nodes, return false if there's none.
+    // Deadlines which were already due when they are scheduled are reported as `current`
+    bool next_expire(uint64_t & expire);
+    size_t size() const {
+        return count;
+    }
+
+    // If the context is accessed by more than one thread, such as `ATPContextServer`, set `shared`
+    bool shared = false;
+protected:
+    void link(ATPTimerNode * node);
+    void unlink(ATPTimerNode * node);
+    // Heads of circular lists
+    ATPTimerNode slots[ATP_TIMER_WHEEL_LEVELS][ATP_TIMER_WHEEL_SLOTS];
+    // The next tick to handle
+    uint64_t current = 0;
+    size_t count = 0;
+    std::mutex mtx;
+};
+
 struct ATPSocket {
     ATPContext * context = nullptr;
     // `sock_id` function as an extra "port", it helps when
@@ -391,21 +521,30 @@ struct ATPSocket {
     uint16_t sock_id;
     // peer sock id is set by ATP_OPT_SOCKID at connection establishing stage
     uint16_t peer_sock_id = 0;
+    // Handle of this socket in `ATPContext::sockets`, 0 if not added
+    uint64_t handle = 0;
 
     mutable ATPAddrHandle local_addr;
+    // Whether `local_addr` is captured from `sockfd`.
+    // Once the fd is bound to a port, `get_local_addr` serves it from memory rather than calling `getsockname`.
+    mutable bool local_addr_cached = false;
     inline ATPAddrHandle & get_local_addr() const {
-        if (conn_state == CS_UNINITIALIZED)
+        if (conn_state == CS_UNINITIALIZED || local_addr_cached)
         {
             return local_addr;
         } else {
-            if (local_addr.host_port() == 0 && local_addr.host_addr() == 0)
-            {
-            }
             socklen_t my_sock_len = sizeof(local_addr.sa);
             getsockname(sockfd, reinterpret_cast<SA*> (&local_addr.sa), &my_sock_len);
+            // An unbound fd gets its port when the kernel auto binds it at the first `sendto`,
+            // so we keep asking until then
+            local_addr_cached = local_addr.host_port() != 0;
             return local_addr;
         }
     }
+    // Call it when the underlying fd is rebound, so `local_addr` is captured again
+    inline void refresh_local_addr() {
+        local_addr_cached = false;
+    }
     ATPAddrHandle dest_addr;
     int family; int type; int protocol;
     int sockfd;
@@ -462,17 +601,27 @@ struct ATPSocket {
     // My seq number acked by peer
     uint32_t my_seq_acked_by_peer = 0;
 
-    // Re-send config
-    uint32_t rtt = 0;
-    uint32_t rtt_var = 800; // Default 800
-    uint32_t rto = 2000; // Default 3000, recommend no less than timer event interval
-    uint32_t ack_delayed_time = 200; // default 200, set 0 to disable delayed ACK
-
-    // These are time point, don't modify
+    // Re-send config, all in microseconds, refer to RFC 6298
+    bool rtt_measured = false;
+    uint64_t srtt_us = 0;
+    uint64_t rttvar_us = 0;
+    uint64_t rto_us = ATP_RTO_INITIAL_US; // recommend no less than timer event interval
+    // 0 to use bounds of the context
+    uint64_t rto_min_us = 0;
+    uint64_t rto_max_us = 0;
+    uint64_t ack_delayed_us = ATP_ACK_DELAYED_US; // set 0 to disable delayed ACK
+    uint64_t get_rto_min_us() const;
+    uint64_t get_rto_max_us() const;
+    // Keep `rto_us` in bounds after they are changed
+    void clamp_rto();
+
+    // These are time point(us of `ATPContext::now_us`), don't modify
     uint64_t delay_ack_timeout = 0; // At this exact timepoint will this socket send delayed ACK, set 0 to cancel a due scheduled ACK
-    uint64_t rto_timeout = 0; // At this exact timepoint(ms) will this socket timeout
+    uint64_t rto_timeout = 0; // At this exact timepoint will this socket timeout
     uint64_t death_timeout = 0; // At this exact timepoint change from TIME_WAIT to DESTROY
     uint64_t persist_timeout = 0; // At this exact timepoint will this socket send probing packet for peer's window
+    // Earliest of the timeouts above, in `ATPContext::timer_wheel`
+    ATPTimerNode timer_node;
 
     // A global counter for transmissions may be worth used
     uint8_t transmission_counter = 0;
@@ -525,6 +674,41 @@ struct ATPSocket {
     uint8_t peer_max_sack_count = 0;
     uint8_t my_max_sack_count = 4;
 #endif
+    // SACK scoreboard, maintained as packets enter and leave `inbuf`, so SACK options are built without scanning `inbuf`.
+    // Bit `seq % ATP_SACK_BITMAP_BITS` is set iff packet with full seq_nr `seq` in (ack_nr, ack_nr + ATP_SACK_BITMAP_BITS]
+    // is cached in `inbuf`. It is large enough for `my_max_sack_count` up to 255 bytes.
+    // A packet leaves `inbuf` only after `ack_nr` reaches its seq_nr, so bits are cleared as `ack_nr` increases.
+    // Packets beyond the range are dropped rather than cached, so every packet in `inbuf` has its bit set.
+#define ATP_SACK_BITMAP_BITS 2048
+    uint64_t sack_bitmap[ATP_SACK_BITMAP_BITS / 64] = {0};
+    bool sack_in_range(uint32_t full_seq) const {
+        return full_seq > ack_nr && full_seq - ack_nr <= ATP_SACK_BITMAP_BITS;
+    }
+    bool sack_test(uint32_t full_seq) const {
+        uint32_t i = full_seq % ATP_SACK_BITMAP_BITS;
+        return sack_in_range(full_seq) && (sack_bitmap[i / 64] & (uint64_t(1) << (i % 64)));
+    }
+    void sack_mark(uint32_t full_seq, bool cached) {
+        uint32_t i = full_seq % ATP_SACK_BITMAP_BITS;
+        if (cached) {
+            if (sack_in_range(full_seq)) sack_bitmap[i / 64] |= (uint64_t(1) << (i % 64));
+        } else {
+            sack_bitmap[i / 64] &= ~(uint64_t(1) << (i % 64));
+        }
+    }
+    void sack_reset() {
+        std::memset(sack_bitmap, 0, sizeof sack_bitmap);
+    }
+
+    // Zero-copy writes not yet cumulatively ACKed, in the order of `last_seq`
+    struct ZeroCopyWrite {
+        uint32_t last_seq; // full_seq_nr of the last packet referencing `buf`
+        const char * buf;
+        size_t len;
+    };
+    std::deque<ZeroCopyWrite> zc_writes;
+    // Describes the datagram for ATP_CALL_SENDTO
+    struct iovec send_iov[2];
 
     // Callbacks
     // typedef atp_result atp_callback_func(atp_callback_arguments *);
@@ -532,6 +716,18 @@ struct ATPSocket {
 
     // Options
     bool reuse_port_flag = false;
+    // Send consecutive packets of the same size as one UDP GSO(UDP_SEGMENT) datagram, refer to `ATPTxQueue`
+    bool gso = false;
+    // UDP_GRO is enabled on `sockfd`, so the standalone loop reads it by `recvfrom_gro`
+    bool gro = false;
+    // Datagrams of at least `zerocopy_min` bytes are sent with MSG_ZEROCOPY, 0 to disable
+    size_t zerocopy_min = 0;
+    // Accepted connections open their own fd, refer to `open_dedicated_fd`
+    bool dedicated_fd = false;
+    // `sockfd` is connected to `dest_addr`, so datagrams are sent without an address
+    bool connected_fd = false;
+    // `sockfd` is opened by `open_dedicated_fd` rather than shared with the listener, and closed with this socket
+    bool owns_fd = false;
     bool on_listen_port = false;
     // When we reset a socket to listening port, we set re_listen = true
     bool re_listen = false;
@@ -561,7 +757,8 @@ struct ATPSocket {
         return DelaySample{0, time_delay.receive_timestamp, time_delay.reply_timestamp, 0};
     }
 
-    ~ATPSocket() {
+    // Derived sockets such as `ATPBlockedSocket` are deleted by `ATPContext::delete_socket`
+    virtual ~ATPSocket() {
 #if defined (ATP_LOG_AT_DEBUG)
         log_debug(this, "Socket destructed.");
 #endif
@@ -572,13 +769,13 @@ struct ATPSocket {
     void register_to_look_up(bool remove_listen);
     atp_callback_arguments make_atp_callback_arguments(ATP_CALLBACKTYPE_ENUM method, OutgoingPacket * out_pkt, const ATPAddrHandle & addr);
     OutgoingPacket * basic_send_packet(uint16_t flags);
-    OutgoingPacket * construct_packet_from_buffer(const char * buffer, size_t len);
+    void view_packet_from_buffer(OutgoingPacket & view, const char * buffer, size_t len);
+    OutgoingPacket * materialize_packet(OutgoingPacket * recv_pkt);
 
     // APIS
     void clear();
-#ifdef _ATP_CLEAR_STATE_FUNC
     void clear_state();
-#endif
+    void reuse(ATPContext * _context);
     // Called by atp_create_socket, returns sockfd
     int init(int family, int type, int protocol);
     int init_fork(ATPSocket * origin);
@@ -588,6 +785,8 @@ struct ATPSocket {
     ATP_PROC_RESULT listen(uint16_t host_port);
     ATP_PROC_RESULT bind(const ATPAddrHandle & to_addr);
     ATP_PROC_RESULT accept(const ATPAddrHandle & to_addr, OutgoingPacket * recv_pkt);
+    // Let the kernel demux this accepted connection by a fd connected to `dest_addr`
+    void open_dedicated_fd();
     ATP_PROC_RESULT receive(OutgoingPacket * recv_pkt, size_t real_payload_offset);
     // `send_packet_noguard` is function who actually sends packets
     ATP_PROC_RESULT send_packet_noguard(OutgoingPacket * out_pkt, bool adhoc = false);
@@ -601,6 +800,8 @@ struct ATPSocket {
     bool eof() const;
     void add_option(OutgoingPacket * out_pkt, uint8_t opt_kind, uint8_t opt_data_len, char * opt_data);
     void add_data(OutgoingPacket * out_pkt, const void * buf, const size_t len);
+    // Reference `len` bytes of user memory instead of copying them
+    void add_ext_data(OutgoingPacket * out_pkt, const void * buf, const size_t len);
     size_t bytes_can_send_once() const;
     size_t bytes_can_send_one_packet(OutgoingPacket * particular_packet = nullptr) const;
     bool is_full(size_t with_extra = 0) const {
@@ -614,6 +815,10 @@ struct ATPSocket {
     // This function returns immediately after the packet is sent(whether succeed or fail)
     ATP_PROC_RESULT write(const void * buf, const size_t len);
     ATP_PROC_RESULT write_oob(const void * buf, const size_t len, uint32_t timeout);
+    // Zero-copy version of `write`, `buf` must be unchanged until `ATP_CALL_ON_SEND_COMPLETE`
+    ATP_PROC_RESULT write_zc(const void * buf, const size_t len);
+    // Call `ATP_CALL_ON_SEND_COMPLETE` for all `write_zc`s whose data are cumulatively ACKed, or all if `abort`
+    void complete_zc(bool abort);
     // This function returns only when got ack from peer
     // ATP_PROC_RESULT blocked_write(const void * buf, const size_t len);
 
@@ -656,6 +861,10 @@ struct ATPSocket {
     void destroy_hard();
     virtual void switch_state(CONN_STATE_ENUM new_state);
     ATP_PROC_RESULT check_timeout();
+    // Schedule `check_timeout` to the earliest timeout, call it when any of the timeouts is changed
+    void arm_timer();
+    // An immediate ACK is deferred to the end of the current burst, refer to `atp_begin_burst`
+    bool burst_ack_pending = false;
     const char * hash_code() const {
         return ATPSocket::make_hash_code(sock_id, dest_addr);
     }
@@ -669,6 +878,11 @@ struct ATPSocket {
         sprintf(hash_str, "[%05u]%s", sock_id, dest_addr.hash_code());
         return const_cast<const char *>(hash_str);
     }
+    // Pack (addr:port) and sock_id into an integer key of `ATPContext::look_up`
+    static uint64_t make_look_up_key(uint16_t sock_id, const ATPAddrHandle & dest_addr) {
+        return (static_cast<uint64_t>(dest_addr.host_addr()) << 32)
+            | (static_cast<uint64_t>(dest_addr.host_port()) << 16) | sock_id;
+    }
 private:
     // 2 * %s + 3 * %05u + 11 of symbols(such as [) + 20 of fd
     mutable char hash_str[INET_ADDRSTRLEN * 2 + 5 * 3 + 11 + 20];
@@ -687,26 +901,133 @@ struct ATPContext {
         fprintf(stderr, "Context destroyed.\n");
 #endif
         clear();
+        if (timer_fd >= 0)
+        {
+            close(timer_fd);
+        }
     }
 
     // Because we have peer_sock_id in ATPPacket,
     // we don't need to wait actually 2msl,
     // waiting for `rto` time is enough.
-    // But you can still set a minimum TIME_WAIT.
+    // But you can still set a minimum TIME_WAIT(ms).
     uint32_t min_msl2 = 6000;
+    // Default RTO bounds of sockets in this context
+    uint64_t rto_min_us = ATP_RTO_MIN_US;
+    uint64_t rto_max_us = ATP_RTO_MAX_US;
 
-    std::vector<ATPSocket *> sockets;
+    // Sockets are destroyed in O(1), and their handles remain checkable after that
+    TSlotMap<ATPSocket> sockets;
     // `look_up` marks every socket's dest_addr and sock_id,
     // so local socket can be located by an in-coming packet
-    std::map<std::string, ATPSocket *> look_up;
+    // keyed by `ATPSocket::make_look_up_key`, so no string is formatted for an in-coming packet
+    TFlatMap<ATPSocket> look_up;
     // All UDP ports this context owns, with a dominant ATPSocket
     std::map<uint16_t, ATPSocket *> listen_sockets;
+    // Listening sockets indexed by their UDP fd, so a SYN can locate its listener
+    // without calling `getsockname` on the fd
+    std::vector<ATPSocket *> listen_fds;
+    // UDP port of every fd our sockets are bound to, taken from their cached local address,
+    // so a SYN arriving on a fd which doesn't listen still locates the listener without `getsockname`
+    std::vector<uint16_t> fd_ports;
+    // Number of sockets using every fd, forked sockets share the fd of their listener
+    std::vector<uint32_t> fd_users;
     std::vector<ATPSocket *> destroyed_sockets;
     uint64_t start_ms;
 
-    uint16_t new_sock_id();
+    // Time of this context in us, which never goes backwards.
+    // During an event(`atp_process_udp`, `atp_timer_event`, or a burst), the clock is read only once,
+    // and all sockets see the same time. The freeze only holds in the thread which froze it,
+    // so other threads writing to sockets of an `ATPContextServer` read the clock themselves.
+    uint64_t now_us();
+    uint64_t now_ms() {
+        return now_us() / 1000;
+    }
+    void set_clock_source(int source);
+    void set_virtual_us(uint64_t us);
+    void freeze_clock();
+    void thaw_clock();
+    int clock_source = ATP_CLOCK_MONOTONIC;
+    uint64_t virtual_us = 0;
+    // Added to the clock source, so the time goes on continuously when the source is changed
+    int64_t clock_offset = 0;
+    // The latest time read by any thread
+    std::atomic<uint64_t> last_us{0};
+    // All packets of sockets in this context are allocated here
+    ATPPacketArena packet_arena;
+    // `daily_routine` only checks sockets whose timeouts are due
+    ATPTimerWheel timer_wheel;
+    std::vector<ATPSocket *> due_sockets;
+    // Refer to `atp_begin_burst`
+    int burst_depth = 0;
+    // Sockets which have ACKs deferred to the end of the burst
+    std::vector<ATPSocket *> burst_acks;
+    void flush_burst_acks();
+    // Time(us) from now to the earliest deadline of all sockets, -1 if there's none
+    int64_t next_timeout_us();
+    // A timerfd armed to the earliest deadline, created by `atp_get_timerfd`
+    int timer_fd = -1;
+    // The tick `timer_fd` is armed to, 0 if it is disarmed
+    uint64_t timer_fd_tick = 0;
+    int get_timer_fd();
+    // Arm `timer_fd` to `tick` if it is earlier than the armed one
+    void request_timer_fd(uint64_t tick);
+    // Re-arm `timer_fd` to the earliest deadline
+    void update_timer_fd();
+    // Bit i is set if sock_id i is in use, sock_id 0 is never used
+    uint64_t sock_id_bitmap[65536 / 64] = {};
+    // Allocation starts from here and moves forward,
+    // so a released sock_id is not reused until all the others are tried,
+    // and late packets of a destroyed socket don't reach a new one.
+    uint16_t sock_id_cursor = 0;
+    // A 65536-entry table from sock_id to its owner, split into 256 pages which are allocated on demand
+    ATPSocket ** sock_id_pages[256] = {};
+    // Bits of sock_ids steered to other shards of a sharded server, for the 4 words of every 256 sock_ids,
+    // because steering only looks at the low byte of a sock_id. Refer to `set_sock_id_shard`
+    uint64_t sock_id_foreign[4] = {};
+    uint16_t sock_id_shard = 0, sock_id_shards = 1;
+
+    // Only allocate sock_ids whose low byte modulo `shards` is `shard`, so packets to them are steered to this context.
+    // sock_ids given by user by `claim_sock_id` are not checked.
+    void set_sock_id_shard(uint16_t shard, uint16_t shards);
+
+    // Allocate a sock_id unique in this context for `owner`, so `owner` can be located by `peer_sock_id` directly
+    uint16_t new_sock_id(ATPSocket * owner);
+    // Return `owner`'s sock_id, if it is still owned by `owner`
+    void release_sock_id(ATPSocket * owner);
+    // Take over a sock_id given by user
+    void claim_sock_id(ATPSocket * owner, uint16_t sock_id);
+    inline ATPSocket * find_socket_by_sock_id(uint16_t sock_id) const {
+        ATPSocket ** page = sock_id_pages[sock_id >> 8];
+        return page == nullptr ? nullptr : page[sock_id & 0xff];
+    }
+    // Get a socket from the socket pool, or construct a new one
+    ATPSocket * new_socket();
+    // Put a socket back to the socket pool, or delete it
+    void delete_socket(ATPSocket * socket);
+    // Let the context drive `socket`, and give it a handle
+    void add_socket(ATPSocket * socket) {
+        socket->handle = sockets.insert(socket);
+        add_fd_user(socket->sockfd);
+    }
     void destroy_socket(ATPSocket * socket);
+    // `socket` is leaving this context, close the fd it opened by `ATPSocket::open_dedicated_fd`,
+    // or drop the zero-copy state of a shared fd if no other socket uses it
+    void release_socket_fd(ATPSocket * socket);
     virtual ATP_PROC_RESULT daily_routine();
+    // A connection opened its own fd, refer to `ATPSocket::open_dedicated_fd`.
+    // A standalone context polls nothing, users poll `atp_getfd` of the connection themselves.
+    virtual void attach_dedicated_fd(int) {}
+    virtual void detach_dedicated_fd(int) {}
+    // Whether a socket of this context still receives from `sockfd`
+    bool fd_in_use(int sockfd) const {
+        return sockfd >= 0 && static_cast<size_t>(sockfd) < fd_users.size() && fd_users[sockfd] > 0;
+    }
+    // Count sockets using `sockfd`, a socket is counted from `add_socket` to `release_socket_fd`
+    void add_fd_user(int sockfd);
+    void remove_fd_user(int sockfd);
+    // Record the port `sockfd` is bound to, 0 forgets the fd
+    void index_fd_port(int sockfd, uint16_t host_port);
     ATPSocket * find_socket_by_fd(const ATPAddrHandle & handle_to, int sockfd);
     ATPSocket * find_socket_by_head(const ATPAddrHandle & handle_to, const ATPPacket * pkt);
     bool finished() const {
@@ -717,18 +1038,33 @@ struct ATPContext {
         if (listen_sockets.find(host_port) == listen_sockets.end())
         {
             listen_sockets[host_port] = socket;
+            if (socket->sockfd >= 0)
+            {
+                if (listen_fds.size() <= static_cast<size_t>(socket->sockfd))
+                {
+                    listen_fds.resize(socket->sockfd + 1, nullptr);
+                }
+                listen_fds[socket->sockfd] = socket;
+                index_fd_port(socket->sockfd, host_port);
+            }
             return ATP_PROC_OK;
         } else {
             return ATP_PROC_ERROR;
         }
     }
 
-    virtual void deregister_listen_port(uint16_t host_port) {
+    // Only `socket` itself is removed, sockets forked from a listener share its port but never listen
+    virtual void deregister_listen_port(ATPSocket * socket, uint16_t host_port) {
         std::map<uint16_t, ATPSocket *>::iterator iter = listen_sockets.find(host_port);
-        if (iter != listen_sockets.end()) {
+        if (iter != listen_sockets.end() && iter->second == socket) {
 #if defined (ATP_LOG_AT_DEBUG)
             log_debug(this, "Remove socket from listening.");
 #endif
+            int fd = iter->second->sockfd;
+            if (fd >= 0 && static_cast<size_t>(fd) < listen_fds.size() && listen_fds[fd] == iter->second)
+            {
+                listen_fds[fd] = nullptr;
+            }
             listen_sockets.erase(iter);
         } else {
 #if defined (ATP_LOG_AT_DEBUG)
@@ -739,10 +1075,149 @@ struct ATPContext {
 
     void register_to_look_up(ATPSocket * socket) {
         // If socket's not registered, context can't find `ATPSocket *` by (addr:port)
-        look_up[ATPSocket::make_hash_code(socket->sock_id, socket->dest_addr)] = socket;
+        look_up.insert(ATPSocket::make_look_up_key(socket->sock_id, socket->dest_addr), socket);
+    }
+};
+
+
+// Keep the clock of `context` frozen during a scope
+struct ATPClockFreezer {
+    ATPClockFreezer(ATPContext * _context) : context(_context) {
+        context->freeze_clock();
+    }
+    ~ATPClockFreezer() {
+        context->thaw_clock();
     }
+    ATPContext * context;
 };
 
+// Datagrams not longer than this are copied into `ATPTxQueue`, rather than holding their buffers
+#define ATP_TX_COPY_MAX 128
+// Limits of a UDP GSO datagram, refer to `ATPSocket::gso`
+#define ATP_GSO_MAX_SEGMENTS 64
+#define ATP_GSO_MAX_BYTES 65000
+
+// Sends the messages built by `ATPTxQueue::flush` instead of `sendmmsg`, such as the io_uring server backend
+struct ATPTxSender {
+    virtual ~ATPTxSender() {}
+    // Like `sendmmsg`. The messages and their data are only valid during the call.
+    virtual int send_msgs(int sockfd, struct mmsghdr * msgs, unsigned int n) = 0;
+    // Called when a flush ends
+    virtual void commit() {}
+};
+
+// Datagrams sent by `normal_sendto` during an `ATPTxBatch` are queued here rather than sent at once.
+// When the outermost `ATPTxBatch` ends, they are sent by one `sendmmsg` per fd.
+// Every thread has its own queue, so the user thread and the server thread of `ATPContextServer` don't interfere.
+struct ATPTxQueue {
+    struct Entry {
+        int sockfd;
+        // Held until sent. If `nullptr`, the datagram is copied to `copied` at `offset`
+        ATPBuffer * buffer;
+        const char * data;
+        size_t offset;
+        size_t length;
+        ATPAddrHandle addr;
+        // Refer to `ATPSocket::gso`
+        bool gso;
+        // Sent with MSG_ZEROCOPY, refer to `ATPZeroCopyRegistry`
+        bool zerocopy;
+        // Refer to `ATPSocket::connected_fd`
+        bool connected;
+    };
+    ~ATPTxQueue() {
+        flush();
+    }
+    void push(int sockfd, const atp_callback_arguments * args);
+    // Send all queued datagrams
+    void flush();
+    // Whether `entry` can follow `head` as a segment of a UDP GSO datagram which already has `segments` segments of `bytes`
+    bool can_segment(const Entry & head, const Entry & entry, size_t segments, size_t bytes) const;
+    void send_segments(int sockfd, struct msghdr & hdr);
+    void enter() {
+        depth++;
+    }
+    void leave() {
+        if (--depth == 0)
+        {
+            flush();
+        }
+    }
+    bool batching() const {
+        return depth > 0;
+    }
+
+    int depth = 0;
+    std::vector<Entry> entries;
+    std::vector<char> copied;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<struct iovec> iovs;
+    std::vector<char> controls;
+    // Index in the fd's group of the first entry of every message
+    std::vector<size_t> msg_entries;
+    // Buffers of the zero-copy messages being sent, and indexes of their entries
+    std::vector<ATPBuffer *> zc_buffers;
+    std::vector<size_t> zc_entries;
+    // Cleared once the kernel rejects UDP_SEGMENT
+    bool gso_supported = true;
+    // Set by the thread which owns the queue, `nullptr` to send by `sendmmsg`
+    ATPTxSender * sender = nullptr;
+    // Number of `sendmmsg` calls, and datagrams sent by them
+    uint64_t sendmmsg_calls = 0;
+    uint64_t sendmmsg_datagrams = 0;
+    // Number of UDP GSO datagrams sent
+    uint64_t gso_sends = 0;
+};
+ATPTxQueue & tx_queue();
+
+// Buffers sent with MSG_ZEROCOPY, each held until the kernel reports by the error queue of the fd that it no longer references them.
+// The kernel numbers zero-copy sends of a fd from 0, so sends of a fd and recording their numbers are done under one lock.
+// Buffers are shared by threads sending on the same fd, so there is one registry per process.
+struct ATPZeroCopyRegistry {
+    struct Pending {
+        uint32_t id;
+        ATPBuffer * buffer;
+    };
+    struct Fd {
+        uint32_t next_id = 0;
+        std::deque<Pending> pending;
+    };
+    ~ATPZeroCopyRegistry();
+    // Send `n` messages with MSG_ZEROCOPY, where message `i` has `msgs[i].msg_hdr.msg_iovlen` buffers in `buffers`.
+    // Returns like `sendmmsg`, and the first `held` buffers are held by the registry, whose references are taken from the caller.
+    // If the kernel is short of memory for zero-copy sends, messages are sent by copying and no buffer is held.
+    int send(int sockfd, struct mmsghdr * msgs, unsigned int n, ATPBuffer * const * buffers, size_t & held);
+    // Release buffers completed on `sockfd`, returns the number of released buffers
+    size_t reap(int sockfd);
+    // `reap` all fds with pending buffers
+    void reap_all();
+    size_t pending(int sockfd);
+    // Enable SO_ZEROCOPY on `sockfd`. If it was not enabled, the fd has sent nothing with MSG_ZEROCOPY,
+    // and state left by a closed fd of the same number is dropped.
+    bool enable(int sockfd);
+    // `sockfd` is about to be closed, `reap` it and release all its buffers.
+    // Pages of sends still in flight stay pinned by the kernel, so they can be reused, but may be sent with new content.
+    void forget(int sockfd);
+
+    std::mutex mtx;
+    std::map<int, Fd> fds;
+    // Buffers held by all fds, checked without locking by `reap_all`
+    std::atomic<size_t> total_pending{0};
+    uint64_t sends = 0;
+    // Sends the kernel completed by copying after all, such as to loopback
+    uint64_t copied = 0;
+};
+ATPZeroCopyRegistry & zerocopy_registry();
+
+// Queue datagrams sent during a scope, refer to `ATPTxQueue`
+struct ATPTxBatch {
+    ATPTxBatch() {
+        tx_queue().enter();
+    }
+    ~ATPTxBatch() {
+        tx_queue().leave();
+    }
+};
 
 void print_out(ATPSocket * socket, OutgoingPacket * out_pkt, const char * method, FILE * stream = nullptr);
 void init_callbacks(ATPSocket * socket);
@@ -25,7 +25,10 @@
 
 ATPSocket::ATPSocket(ATPContext * _context) : context(_context){
     assert(context != nullptr);
-    sock_id = context->new_sock_id();
+    sock_id = context->new_sock_id(this);
+    timer_node.owner = this;
+    // Bounds of the context may be changed
+    clamp_rto();
     conn_state = CS_UNINITIALIZED;
     memset(hash_str, 0, sizeof hash_str);
     memset(callbacks, 0, sizeof callbacks);
@@ -43,7 +46,9 @@ atp_callback_arguments ATPSocket::make_atp_callback_arguments(ATP_CALLBACKTYPE_E
             0, nullptr, 
             conn_state,
             reinterpret_cast<const SA*>(&(addr.sa)),
-            sizeof(sockaddr_in)
+            sizeof(sockaddr_in),
+            nullptr,
+            nullptr, 0
         };
     }else{
         return atp_callback_arguments{
@@ -53,7 +58,9 @@ atp_callback_arguments ATPSocket::make_atp_callback_arguments(ATP_CALLBACKTYPE_E
             out_pkt->length, out_pkt->data, 
             conn_state,
             reinterpret_cast<const SA*>(&(addr.sa)),
-            sizeof(sockaddr_in)
+            sizeof(sockaddr_in),
+            out_pkt->observer ? nullptr : out_pkt->get_buffer(),
+            nullptr, 0
         };
     }
 }
@@ -68,20 +75,14 @@ OutgoingPacket * ATPSocket::basic_send_packet(uint16_t flags){
         (uint8_t)flags, // flags
         (uint16_t)my_window // my window
     };
-    OutgoingPacket * out_pkt = new OutgoingPacket{
-        0, // observer
-        0, // marked
-        0, // selective_acked
-        0, // ahead_handled
-        0, // need_resend, update by `send_packet`/`check_unsend_packet`
-        sizeof (ATPPacket), // length, update by `add_data`
-        0, // payload, update by `add_data`/`add_option`
-        0, // option_len, update by `add_option`
-        0, // timestamp, set at `send_packet_noguard`
-        0, // transmissions, update by `send_packet_noguard`
-        seq_nr, // full_seq_nr, updated in send_packet
-        reinterpret_cast<char *>(std::calloc(1, sizeof (ATPPacket))) // SYN packet will not contain data
-    };
+    // All fields of a fetched packet are zeroed, `data` has room for a full MSS
+    OutgoingPacket * out_pkt = context->packet_arena.fetch(sizeof (ATPPacket));
+    out_pkt->length = sizeof (ATPPacket); // update by `add_data`
+    // payload, update by `add_data`/`add_option`
+    // option_len, update by `add_option`
+    // timestamp, set at `send_packet_noguard`
+    // transmissions, update by `send_packet_noguard`
+    out_pkt->full_seq_nr = seq_nr; // updated in send_packet
     std::memcpy(out_pkt->data, &pkt, sizeof (ATPPacket));
     return out_pkt;
 }
@@ -89,21 +90,32 @@ OutgoingPacket * ATPSocket::basic_send_packet(uint16_t flags){
 
 void ATPSocket::clear(){
     for(OutgoingPacket * op : outbuf){
-        delete op;
+        context->packet_arena.release(op);
     }
     outbuf.clear();
     for(OutgoingPacket * op : inbuf){
-        delete op;
+        context->packet_arena.release(op);
     }
     inbuf.clear();
+    sack_reset();
+    for(OutgoingPacket * op : inbuf_cache2){
+        context->packet_arena.release(op);
+    }
+    inbuf_cache2.clear();
+    // Packets referencing user memory are all released, let users reuse the memory
+    complete_zc(true);
+    // Keep `outbuf` usable, because a socket can be reused by `reuse`
+    outbuf.init();
 }
 
-#ifdef _ATP_CLEAR_STATE_FUNC
 void ATPSocket::clear_state(){
-    sock_id = context->new_sock_id();
+    context->release_sock_id(this);
+    sock_id = context->new_sock_id(this);
 
     memset(hash_str, 0, sizeof hash_str);
-    memset(callbacks, 0, sizeof callbacks);
+    for(auto & callback : callbacks){
+        callback = nullptr;
+    }
     init_callbacks(this);
 
     peer_sock_id = 0;
@@ -111,20 +123,27 @@ void ATPSocket::clear_state(){
 
     seq_nr = 0;
     ack_nr = 0;
+    sack_reset();
     overflow_lock = false;
     new_stage_hitted = false;
     peer_seq_nr_base = 0;
     my_seq_acked_by_peer = 0;
 
-    rtt = 0;
-    rtt_var = 800; 
-    rto = 2000; 
-    ack_delayed_time = 200; 
+    rtt_measured = false;
+    srtt_us = 0;
+    rttvar_us = 0;
+    rto_min_us = 0;
+    rto_max_us = 0;
+    rto_us = ATP_RTO_INITIAL_US;
+    clamp_rto();
+    ack_delayed_us = ATP_ACK_DELAYED_US;
 
     delay_ack_timeout = 0; 
     rto_timeout = 0; 
     death_timeout = 0; 
     persist_timeout = 0; 
+    context->timer_wheel.cancel(&timer_node);
+    burst_ack_pending = false;
 
     transmission_counter = 0;
     atp_retries1 = 3; 
@@ -156,16 +175,43 @@ void ATPSocket::clear_state(){
 
     // Options
     reuse_port_flag = false;
+    gso = false;
+    gro = false;
+    zerocopy_min = 0;
+    dedicated_fd = false;
+    connected_fd = false;
+    owns_fd = false;
     on_listen_port = false;
 
 
     last_receive_timestamp = 0;
     last_send_timestamp = 0;
 }
-#endif
+
+void ATPSocket::reuse(ATPContext * _context){
+    // Reset a socket fetched from the socket pool, as if it is newly constructed by `ATPSocket(_context)`.
+    // Packets of this socket are already released by `clear` before it was put back to the pool.
+    assert(_context != nullptr);
+    context = _context;
+    // The node may still be linked to a wheel which is already cleared
+    timer_node = ATPTimerNode();
+    timer_node.owner = this;
+    clear_state();
+    conn_state = CS_UNINITIALIZED;
+    local_addr = ATPAddrHandle();
+    local_addr_cached = false;
+    handle = 0;
+    family = type = protocol = 0;
+    sockfd = -1;
+    re_listen = false;
+}
 
 int ATPSocket::init(int family, int type, int protocol){
     switch_state(CS_IDLE);
+    // Kept for forked sockets, which open their own fd by `open_dedicated_fd`
+    this->family = family;
+    this->type = type;
+    this->protocol = protocol;
     sockfd = socket(family, type, protocol);
     get_local_addr().family() = family;
     dest_addr.family() = family;
@@ -182,10 +228,22 @@ int ATPSocket::init_fork(ATPSocket * origin){
     type = origin->type;
     protocol = origin->protocol;
 
+    // Forked socket shares the fd, so it shares the local address
+    local_addr = origin->get_local_addr();
+    local_addr_cached = origin->local_addr_cached;
     get_local_addr().family() = family;
     dest_addr.family() = family;
+    if (local_addr_cached)
+    {
+        context->index_fd_port(sockfd, local_addr.host_port());
+    }
 
     reuse_port_flag = true;
+    gso = origin->gso;
+    // The fd is shared, so is its GRO setting
+    gro = origin->gro;
+    zerocopy_min = origin->zerocopy_min;
+    dedicated_fd = origin->dedicated_fd;
 
     #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
         log_debug(this, "UDP Socket forked from %s, sockfd %d.", origin->to_string(), sockfd);
@@ -218,6 +276,8 @@ ATP_PROC_RESULT ATPSocket::connect(const ATPAddrHandle & to_addr){
     // before sending packet, users can do something, like call `connect` to their UDP socket.
     atp_callback_arguments arg = make_atp_callback_arguments(ATP_CALL_CONNECT, out_pkt, dest_addr);
     ATP_PROC_RESULT result = invoke_callback(ATP_CALL_CONNECT, &arg);
+    // The callback may `connect` the UDP socket, which binds it implicitly
+    refresh_local_addr();
 
     #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
         log_debug(this, "UDP socket connect to %s.", dest_addr.to_string());
@@ -226,7 +286,7 @@ ATP_PROC_RESULT ATPSocket::connect(const ATPAddrHandle & to_addr){
         #if defined (ATP_LOG_AT_DEBUG)
             log_debug(this, "Connect Failed.");
         #endif
-        delete out_pkt;
+        context->packet_arena.release(out_pkt);
         out_pkt = nullptr;
     } else{
         result = send_packet(out_pkt);
@@ -251,22 +311,29 @@ ATP_PROC_RESULT ATPSocket::listen(uint16_t host_port){
         #if defined (ATP_LOG_AT_DEBUG)
         log_debug(this, "I am listening on port %u.", host_port);
         #endif
+        return ATP_PROC_OK;
     }
+    return ATP_PROC_ERROR;
 }
 
 ATP_PROC_RESULT ATPSocket::bind(const ATPAddrHandle & to_addr){
     // There's no OutgoingPacket to be sent, so pass `nullptr`
     atp_callback_arguments arg = make_atp_callback_arguments(ATP_CALL_BIND, nullptr, to_addr);
     ATP_PROC_RESULT result = invoke_callback(ATP_CALL_BIND, &arg);
+    refresh_local_addr();
+    if (result != ATP_PROC_ERROR)
+    {
+        context->index_fd_port(sockfd, get_local_addr().host_port());
+    }
     return result;
 }
 
 ATPSocket * ATPSocket::fork_basic(){
     // Forked socket ans origin socket share the same sockfd,
     // and is distinguished by sock_id
-    ATPSocket * socket = new ATPSocket(context);
+    ATPSocket * socket = context->new_socket();
     int sockfd = socket->init_fork(this);
-    context->sockets.push_back(socket);
+    context->add_socket(socket);
     return socket;
 }
 
@@ -284,6 +351,11 @@ ATP_PROC_RESULT ATPSocket::accept(const ATPAddrHandle & to_addr, OutgoingPacket
         // if(re_listen) {
         //     goto REUSED_SOCKET;
         // }
+        if (conn_state == CS_LISTEN && reuse_port_flag && dedicated_fd && callbacks[ATP_CALL_ON_FORK] != nullptr)
+        {
+            // A listener never leaves its fd, so the first connection is forked like later ones, and opens its own fd
+            goto REUSED_SOCKET;
+        }
     }else if(reuse_port_flag) {
         // Port reusing is allowed, so this socket will not be removed from listening queue.
 REUSED_SOCKET:
@@ -343,9 +415,14 @@ REUSED_SOCKET:
         if(!reuse_port_flag){
             // If we don't need to reuse port, we will remove socket from listening
             on_listen_port = false;
-            context->deregister_listen_port(get_local_addr().host_port());
+            context->deregister_listen_port(this, get_local_addr().host_port());
         }
         context->register_to_look_up(this);
+        if (dedicated_fd)
+        {
+            // Before the SYN-ACK, so it leaves from the fd which the peer will be demuxed to
+            open_dedicated_fd();
+        }
     #if defined (ATP_LOG_AT_NOTE) 
         print_out(this, recv_pkt, "rcv");
     #endif
@@ -367,6 +444,66 @@ REUSED_SOCKET:
     return result;
 }
 
+void ATPSocket::open_dedicated_fd(){
+    if (on_listen_port || sockfd < 0)
+    {
+        // The listener keeps listening on its fd
+        return;
+    }
+    int fd = sockfd;
+    if (reuse_port_flag)
+    {
+        // A forked socket shares the listener's fd, open another one on the same port.
+        // A connected UDP socket is preferred by the kernel over the listening ones, so the peer's datagrams arrive here.
+        sockaddr_in local = get_local_addr().sa; socklen_t local_len = sizeof(local);
+        int on = 1;
+        fd = socket(family, type, protocol);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0
+            || ::bind(fd, reinterpret_cast<SA *>(&local), local_len) < 0)
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(this, "Can't open a dedicated fd, keep sharing fd %d.", sockfd);
+            #endif
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            return;
+        }
+    }
+    // Otherwise this socket was the listener, and its fd is no longer listened on, connect it in place
+    if (::connect(fd, reinterpret_cast<const SA *>(&dest_addr.sa), sizeof(sockaddr_in)) < 0)
+    {
+        #if defined (ATP_LOG_AT_DEBUG)
+            log_debug(this, "Can't connect fd %d to %s.", fd, dest_addr.hash_code());
+        #endif
+        if (fd != sockfd)
+        {
+            ::close(fd);
+        }
+        return;
+    }
+    connected_fd = true;
+    if (fd != sockfd)
+    {
+        context->remove_fd_user(sockfd);
+        sockfd = fd;
+        owns_fd = true;
+        context->add_fd_user(sockfd);
+        // Options of the shared fd
+        gro = gro && enable_udp_gro(sockfd);
+        if (zerocopy_min > 0 && !zerocopy_registry().enable(sockfd))
+        {
+            zerocopy_min = 0;
+        }
+        context->index_fd_port(sockfd, get_local_addr().host_port());
+        context->attach_dedicated_fd(sockfd);
+    }
+    #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
+        log_debug(this, "UDP Socket connected to %s, sockfd %d.", dest_addr.hash_code(), sockfd);
+    #endif
+}
+
 ATP_PROC_RESULT ATPSocket::receive(OutgoingPacket * recv_pkt, size_t real_payload_offset){
     if (recv_pkt->get_head()->get_fin())
     {
@@ -402,8 +539,9 @@ ATP_PROC_RESULT ATPSocket::receive(OutgoingPacket * recv_pkt, size_t real_payloa
 
 ATP_PROC_RESULT ATPSocket::send_packet_noguard(OutgoingPacket * out_pkt, bool adhoc){
     // argument `adhoc`, which is usually set to false, is used by debuggers who can send simulated packets by `send_packet_noguard`
-    uint64_t current_ms = get_current_ms();
-    rto_timeout = current_ms + rto;
+    uint64_t current_us = context->now_us();
+    rto_timeout = current_us + rto_us;
+    arm_timer();
     if (out_pkt->transmissions == 0 && out_pkt->is_promised_packet() && !out_pkt->get_head()->get_urg() && !adhoc)
     {
         used_window_packets++;
@@ -435,9 +573,25 @@ ATP_PROC_RESULT ATPSocket::send_packet_noguard(OutgoingPacket * out_pkt, bool ad
         print_out(this, out_pkt, b, stderr);
         #endif
     #endif
-    out_pkt->timestamp = current_ms;
+    out_pkt->timestamp = current_us;
+    if (out_pkt->transmissions == 0 && !out_pkt->observer)
+    {
+        // Before anyone else can retain this buffer
+        out_pkt->get_buffer()->addr = dest_addr;
+    }
     out_pkt->transmissions++;
     atp_callback_arguments arg = make_atp_callback_arguments(ATP_CALL_SENDTO, out_pkt, dest_addr);
+    send_iov[0].iov_base = out_pkt->data;
+    send_iov[0].iov_len = out_pkt->inline_length();
+    arg.length = out_pkt->inline_length();
+    arg.iov = send_iov;
+    arg.iov_count = 1;
+    if (out_pkt->ext_len > 0)
+    {
+        send_iov[1].iov_base = const_cast<char *>(out_pkt->ext_data);
+        send_iov[1].iov_len = out_pkt->ext_len;
+        arg.iov_count = 2;
+    }
     if (out_pkt->need_resend)
     {
         out_pkt->need_resend = false;
@@ -479,6 +633,9 @@ void ATPSocket::check_unsend_packet(){
 
 ATP_PROC_RESULT ATPSocket::send_packet(OutgoingPacket * out_pkt, bool flush_packets, bool adhoc){
     ATP_PROC_RESULT result = ATP_PROC_OK;
+    // Once pushed to `outbuf`, `out_pkt` may be ACKed and released back to the arena(by another thread for `ATPContextServer`),
+    // so read what we need beforehand
+    bool carries_ack = out_pkt->get_head()->get_ack();
     // Setup packets
     // When the package is constructed, update `seq_nr` for the next package
     if (out_pkt->is_promised_packet() && !out_pkt->need_resend)
@@ -507,10 +664,11 @@ ATP_PROC_RESULT ATPSocket::send_packet(OutgoingPacket * out_pkt, bool flush_pack
             // Send Empty ACK immediately
             // ACK packet is ad-hoc sent packet, don't enqueue to `outbuf`(always delete at once(except SYN, FIN))
             result = send_packet_noguard(out_pkt);
-            delete out_pkt;
+            context->packet_arena.release(out_pkt);
             out_pkt = nullptr;
             // Cancel schedule_ack
             delay_ack_timeout = 0;
+            burst_ack_pending = false;
         }else if(out_pkt->get_head()->get_syn()){
             // SYN Packet will always be sent immediately and pushed into `outbuf`
             result = send_packet_noguard(out_pkt);
@@ -530,14 +688,14 @@ ATP_PROC_RESULT ATPSocket::send_packet(OutgoingPacket * out_pkt, bool flush_pack
         #endif
         PUSH_OUTBUF(out_pkt);
     }
-    if (out_pkt != nullptr)
+    if (out_pkt != nullptr && carries_ack)
     {
         // Cancel schedule_ack
-        assert(out_pkt->data != nullptr);
-        if(out_pkt->get_head()->get_ack()){
-            delay_ack_timeout = 0;
-        }
+        delay_ack_timeout = 0;
+        burst_ack_pending = false;
     }
+    // `outbuf` may be no longer empty, so `rto_timeout` should be watched
+    arm_timer();
     return result;
 }
 
@@ -628,24 +786,49 @@ void ATPSocket::add_data(OutgoingPacket * out_pkt, const void * buf, const size_
     (out_pkt->length) += len;
     (out_pkt->payload) += len;
     assert(out_pkt->length == out_pkt->payload + sizeof(ATPPacket));
-    out_pkt->data = reinterpret_cast<char *>(std::realloc(out_pkt->data, out_pkt->length));
+    // Can't append after referenced user data
+    assert(out_pkt->ext_len == 0);
+    // Usually no-op, because a slot can hold a full MSS
+    context->packet_arena.reserve(out_pkt, out_pkt->length);
     memcpy(out_pkt->data + (out_pkt->length - len), buf, len);
     assert(out_pkt->data != nullptr);
 }
 
+void ATPSocket::add_ext_data(OutgoingPacket * out_pkt, const void * buf, const size_t len){
+    assert(out_pkt->ext_len == 0);
+    out_pkt->ext_data = reinterpret_cast<const char *>(buf);
+    out_pkt->ext_len = len;
+    (out_pkt->length) += len;
+    (out_pkt->payload) += len;
+    assert(out_pkt->length == out_pkt->payload + sizeof(ATPPacket));
+}
+
 void ATPSocket::add_option(OutgoingPacket * out_pkt, uint8_t opt_kind, uint8_t opt_data_len, char * opt_data){
     out_pkt->get_head()->opts_count++;
     uint8_t opt_len = opt_data_len + sizeof(uint8_t) * 2;
     size_t prev_opt_len = out_pkt->option_len;
-    out_pkt->data = reinterpret_cast<char *>(std::realloc(out_pkt->data, out_pkt->length + opt_len));
-    if (out_pkt->real_payload() != 0)
+    if (out_pkt->real_payload() - out_pkt->ext_len != 0)
     {
-        // If there is user data, must move them to make room for new options
-        std::memmove(out_pkt->data + sizeof(ATPPacket) + prev_opt_len + opt_len, out_pkt->data + sizeof(ATPPacket) + prev_opt_len, out_pkt->real_payload());
+        // If there is user data, must make room for new options between options and user data.
+        if (out_pkt->headroom >= opt_len)
+        {
+            // Move the head and previous options backward into the headroom, which costs O(option size)
+            std::memmove(out_pkt->data - opt_len, out_pkt->data, sizeof(ATPPacket) + prev_opt_len);
+            out_pkt->data -= opt_len;
+            out_pkt->headroom -= opt_len;
+            out_pkt->capacity += opt_len;
+        }else{
+            // Headroom exhausted, move user data forward
+            context->packet_arena.reserve(out_pkt, out_pkt->inline_length() + opt_len);
+            std::memmove(out_pkt->data + sizeof(ATPPacket) + prev_opt_len + opt_len, out_pkt->data + sizeof(ATPPacket) + prev_opt_len, out_pkt->real_payload() - out_pkt->ext_len);
+        }
+    }else{
+        context->packet_arena.reserve(out_pkt, out_pkt->inline_length() + opt_len);
     }
-    *reinterpret_cast<uint8_t *>(out_pkt->data + out_pkt->length) = opt_kind;
-    *reinterpret_cast<uint8_t *>(out_pkt->data + out_pkt->length + sizeof(uint8_t)) = opt_data_len;
-    memcpy(out_pkt->data + out_pkt->length + sizeof(uint8_t) * 2, opt_data, opt_data_len);
+    char * opt = out_pkt->data + sizeof(ATPPacket) + prev_opt_len;
+    *reinterpret_cast<uint8_t *>(opt) = opt_kind;
+    *reinterpret_cast<uint8_t *>(opt + sizeof(uint8_t)) = opt_data_len;
+    memcpy(opt + sizeof(uint8_t) * 2, opt_data, opt_data_len);
     out_pkt->length += opt_len;
     out_pkt->payload += opt_len;
     out_pkt->option_len += opt_len;
@@ -828,16 +1011,76 @@ ATP_PROC_RESULT ATPSocket::write(const void * buf, const size_t len){
             p += add_len;
         }
     }
-    // Flush packets when all packets are created
+    // Flush packets when all packets are created, they are sent together by `sendmmsg`
+    ATPTxBatch batch;
     check_unsend_packet();
     // Successfully sent `p` bytes of data
     return p;
 }
 
+ATP_PROC_RESULT ATPSocket::write_zc(const void * buf, const size_t len){
+    // Same as `write`, except that packets reference `buf` rather than copying from it.
+    // `buf` is referenced until all these packets are cumulatively ACKed, which is notified by `ATP_CALL_ON_SEND_COMPLETE`.
+    if (!writable())
+    {
+        #if defined (ATP_LOG_AT_DEBUG)
+            log_debug(this, "ERROR: This socket is not writable.");
+        #endif
+        return ATP_PROC_ERROR;
+    }
+    const char * data = reinterpret_cast<const char *>(buf);
+    size_t p = 0;
+    uint32_t last_seq = 0;
+    while(p < len){
+        if (bytes_can_send_once() == 0)
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(this, "Window restricted, total %u, used %u, will only partially send.", cur_window, used_window);
+            #endif
+            break;
+        }
+        OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
+        size_t add_len = std::min(bytes_can_send_one_packet(out_pkt), len - p);
+        add_ext_data(out_pkt, data + p, add_len);
+
+        ATP_PROC_RESULT result = send_packet(out_pkt, false);
+        if (result == ATP_PROC_ERROR)
+        {
+            break;
+        }
+        // `out_pkt` may be ACKed and released once pushed to `outbuf`, it took `seq_nr` of the socket
+        last_seq = seq_nr;
+        p += add_len;
+    }
+    if (p > 0)
+    {
+        // `ATP_CALL_ON_SEND_COMPLETE` covers only the accepted `p` bytes
+        zc_writes.push_back(ZeroCopyWrite{last_seq, data, p});
+    }
+    check_unsend_packet();
+    return p;
+}
+
+void ATPSocket::complete_zc(bool abort){
+    while(!zc_writes.empty()){
+        ZeroCopyWrite & zc = zc_writes.front();
+        if (!abort && zc.last_seq > my_seq_acked_by_peer)
+        {
+            break;
+        }
+        atp_callback_arguments arg = make_atp_callback_arguments(ATP_CALL_ON_SEND_COMPLETE, nullptr, dest_addr);
+        arg.data = const_cast<char *>(zc.buf);
+        arg.length = zc.len;
+        arg.error_code = abort ? ATP_PROC_ERROR : ATP_PROC_OK;
+        zc_writes.pop_front();
+        invoke_callback(ATP_CALL_ON_SEND_COMPLETE, &arg);
+    }
+}
+
 ATP_PROC_RESULT ATPSocket::check_fin(OutgoingPacket * recv_pkt){
     // return >0: OK
     // return -1: error
-    uint64_t current_ms = get_current_ms();
+    uint64_t current_us = context->now_us();
     ATP_PROC_RESULT result = ATP_PROC_OK;
     switch(conn_state){
         case CS_UNINITIALIZED:
@@ -876,10 +1119,10 @@ ATP_PROC_RESULT ATPSocket::check_fin(OutgoingPacket * recv_pkt){
         {
             // Receive FIN from peer
             switch_state(CS_TIME_WAIT);
-            uint64_t current_ms = get_current_ms();
-            death_timeout = current_ms + std::max(context->min_msl2, rto);
+            death_timeout = current_us + std::max(static_cast<uint64_t>(context->min_msl2) * 1000, rto_us);
+            arm_timer();
             #if defined (ATP_LOG_AT_DEBUG)
-                log_debug(this, "Recv peer's FIN, Send the last ACK to Peer, wait 2MSL from %u to %u.", current_ms, death_timeout);
+                log_debug(this, "Recv peer's FIN, Send the last ACK to Peer, wait 2MSL from %llu to %llu.", current_us, death_timeout);
             #endif
             // Send no scheduled ACK
             OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
@@ -905,7 +1148,8 @@ ATP_PROC_RESULT ATPSocket::check_fin(OutgoingPacket * recv_pkt){
             #if defined (ATP_LOG_AT_DEBUG)
                 log_debug(this, "Peer resend FIN, send ack.");
             #endif
-            death_timeout = current_ms + std::max(context->min_msl2, rto);
+            death_timeout = current_us + std::max(static_cast<uint64_t>(context->min_msl2) * 1000, rto_us);
+            arm_timer();
             // Send no scheduled ACK
             OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
             result = send_packet(out_pkt);
@@ -1100,8 +1344,16 @@ ATP_PROC_RESULT ATPSocket::update_myack(OutgoingPacket * recv_pkt){
                 log_debug(this, "This is a normal seq_nr:%u(%u), my_ack is:%u.", peer_seq, raw_peer_seq, ack_nr);
             #endif
             ack_nr ++;
+            // Bit of the new `ack_nr` will be reused by `ack_nr + ATP_SACK_BITMAP_BITS`
+            sack_mark(ack_nr, false);
             reorder_count = 0;
             action = ATP_PROC_OK;
+        } else if (!sack_in_range(peer_seq)){
+            // Too far ahead to be tracked by the SACK scoreboard, the peer will re-send it
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(this, "This is a too early seq_nr:%u(%u), my_ack is:%u, DROP!", peer_seq, raw_peer_seq, ack_nr);
+            #endif
+            action = ATP_PROC_DROP;
         } else{
             // there is at least one packet not acked before this packet, so we can't ack this
             reorder_count++;
@@ -1243,6 +1495,7 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet_hard(OutgoingPacket * recv_pkt){
     // peer_sock_id = *reinterpret_cast<uint16_t *>(recv_pkt->data + sizeof(ATPPacket));
     // Must FORCE set ack_nr, because now ack_nr is still 0
     ack_nr = recv_pkt->get_head()->seq_nr;
+    sack_reset();
     // Get peer's window
     uint16_t new_peer_window = recv_pkt->get_head()->window_size;
     if (new_peer_window != peer_window)
@@ -1263,44 +1516,34 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
         // If reorder_count == 0 then all packet come in order, there no need to send SACK
         OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
 
-        // Find all packets
+        // Build from the SACK scoreboard, rather than scanning `inbuf`
         #ifdef USE_OLD_SACK_FIELD
             size_t size = std::min(static_cast<size_t>(peer_max_sack_count), inbuf.size());
-            uint16_t * sack_data = new uint16_t[size] ();
+            uint16_t sack_data[UINT8_MAX] = {0};
             uint8_t sack_seq_count = 0;
-            size_t loop_end = size;
+            for(uint32_t offset = 0; offset < ATP_SACK_BITMAP_BITS && sack_seq_count < size; offset++){
+                uint32_t cached_seq = ack_nr + 1 + offset;
+                if (sack_test(cached_seq))
+                {
+                    sack_data[sack_seq_count] = cached_seq & seq_nr_mask;
+                    sack_seq_count++;
+                }
+            }
         #else
             // bit-wise size
             size_t size = std::min(static_cast<size_t>(peer_max_sack_count) * 8, inbuf.size());
             // byte-wise size
             size_t byte_size = size % 8 == 0 ? (size / 8): (size / 8 + 1);
-            uint8_t * sack_data = new uint8_t[byte_size] ();
+            uint8_t sack_data[UINT8_MAX] = {0};
             uint8_t sack_seq_count = 0;
-            size_t loop_end = inbuf.size();
-        #endif
-        for(auto i = 0; i < loop_end; i++){
-            OutgoingPacket * cached_pkt = inbuf[i];
-            uint32_t cached_seq = guess_full_seq_nr(cached_pkt->get_head()->seq_nr);
-            #ifdef USE_OLD_SACK_FIELD
-                if (cached_seq > ack_nr)
+            for(uint32_t offset = 0; offset < size; offset++){
+                if (sack_test(ack_nr + 1 + offset))
                 {
-                    sack_data[sack_seq_count] = cached_pkt->get_head()->seq_nr;
+                    sack_data[offset / 8] |= (1 << (offset % 8));
                     sack_seq_count++;
                 }
-                // Only put in `size` seq_nrs
-                if (sack_seq_count == size) break;
-            #else
-                if (cached_seq > ack_nr)
-                {
-                    uint32_t offset = cached_seq - (ack_nr + 1);
-                    if(offset >= size) {continue;}
-                    uint32_t byte_offset = offset / 8;
-                    uint32_t bit_offset = offset % 8;
-                    sack_data[byte_offset] |= (1 << bit_offset);
-                    sack_seq_count++;
-                }
-            #endif
-        }
+            }
+        #endif
         if (sack_seq_count > 0)
         {
             // If there are some packets to SACK
@@ -1329,9 +1572,6 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
                 add_option(out_pkt, ATP_OPT_SACK, static_cast<uint8_t>(byte_size)
                     , reinterpret_cast<char*>(sack_data));
             #endif
-            // `add_option` `memcpy` `sack_data`
-            delete sack_data;
-            sack_data = nullptr;
             send_packet(out_pkt);
         }else{
             // If there's no packets to SACK
@@ -1344,7 +1584,7 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
                 #endif
                 send_packet(out_pkt);
             #else
-                delete out_pkt;
+                context->packet_arena.release(out_pkt);
                 out_pkt = nullptr;
             #endif
         }
@@ -1364,7 +1604,7 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
         #if defined (ATP_LOG_AT_NOTE)
             print_out(this, recv_pkt, "drop");
         #endif
-        delete recv_pkt;
+        context->packet_arena.release(recv_pkt);
         recv_pkt = nullptr;
         // Maybe peer has not receive my ACK, so it keep re-sending ACK
         schedule_ack();
@@ -1393,6 +1633,9 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
             #endif
             std::copy(inbuf_cache2.begin(), inbuf_cache2.end(), std::back_inserter(inbuf));
             std::make_heap(inbuf.begin(), inbuf.end(), _cmp_outgoingpacket());
+            for(OutgoingPacket * p : inbuf_cache2){
+                sack_mark(p->full_seq_nr, true);
+            }
             inbuf_cache2.clear();
             #if defined (ATP_LOG_AT_DEBUG)
                 log_debug(this, "Handled all packets before overflow, inbuf size: %u.", inbuf.size());
@@ -1445,6 +1688,7 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
                 );
                 if (repeated == inbuf_cache2.end())
                 {
+                    recv_pkt = materialize_packet(recv_pkt);
                     inbuf_cache2.push_back(recv_pkt);
                     #if defined (ATP_LOG_AT_DEBUG)
                         log_debug(this, "Cached packet to inbuf_cache2, ack:%u raw_peer_seq:%u inbuf_size: %u.", ack_nr, raw_peer_seq, inbuf.size());
@@ -1456,21 +1700,19 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
                     #if defined (ATP_LOG_AT_NOTE)
                         print_out(this, recv_pkt, "cache-rep2");
                     #endif
-                    delete recv_pkt;
+                    context->packet_arena.release(recv_pkt);
                     recv_pkt = nullptr;
                 }
             }else{
-                // Cache into inbuf
-                auto repeated = std::find_if(inbuf.begin(), inbuf.end(), 
-                    [=](OutgoingPacket * op){
-                        return op->get_head()->seq_nr == recv_pkt->get_head()->seq_nr;
-                    }
-                );
-                if (repeated == inbuf.end())
+                // Cache into inbuf, only packets in range of the scoreboard are cached, so it tells whether this packet is cached
+                bool repeated = sack_test(peer_seq);
+                if (!repeated)
                 {
                     // Not repeated
+                    recv_pkt = materialize_packet(recv_pkt);
                     inbuf.push_back(recv_pkt);
                     std::push_heap(inbuf.begin(), inbuf.end(), _cmp_outgoingpacket());
+                    sack_mark(peer_seq, true);
                     #if defined (ATP_LOG_AT_DEBUG)
                         log_debug(this, "Cached packet to inbuf, ack:%u raw_peer_seq:%u inbuf_size: %u.", ack_nr, raw_peer_seq, inbuf.size());
                     #endif
@@ -1481,7 +1723,7 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
                     #if defined (ATP_LOG_AT_NOTE)
                         print_out(this, recv_pkt, "cache-rep");
                     #endif
-                    delete recv_pkt;
+                    context->packet_arena.release(recv_pkt);
                     recv_pkt = nullptr;
                 }
             }
@@ -1494,28 +1736,45 @@ ATP_PROC_RESULT ATPSocket::handle_recv_packet(OutgoingPacket * recv_pkt, bool fr
     return action;
 }
 
-OutgoingPacket * ATPSocket::construct_packet_from_buffer(const char * buffer, size_t len){
-    // This function construct a new OutgoingPacket from buffer.
-    // Must **copy** from "kernel", rather than operate in-place, because buffer is limited
-    OutgoingPacket * recv_pkt = new OutgoingPacket();
-    recv_pkt->data = reinterpret_cast<char *>(std::calloc(1, len));
-    std::memcpy(recv_pkt->data, buffer, len);
-    recv_pkt->length = len;
-    recv_pkt->payload = recv_pkt->length - sizeof(ATPPacket);
-    recv_pkt->update_real_payload();
-    recv_pkt->timestamp = get_current_ms();
-    return recv_pkt;
+void ATPSocket::view_packet_from_buffer(OutgoingPacket & view, const char * buffer, size_t len){
+    // This function parses the head and options of a packet in place, on the caller's buffer.
+    // The buffer is limited(usually reused by the next `recvfrom`), so `view` is only valid in `process`.
+    // Most in-order packets are delivered to `ATP_CALL_ON_RECV` and then dropped, so they are never copied.
+    // Packets which need to outlive `process` must be copied by `materialize_packet`.
+    view = OutgoingPacket{
+        1, 0, 0, 0, 0, 0, // observer, marked, selective_acked, ahead_handled, need_resend, spilled
+        len, len - sizeof(ATPPacket), 0, // length, payload, option_len
+        context->now_us(), // timestamp
+        0, 0, // transmissions, full_seq_nr
+        const_cast<char *>(buffer), len, 0, // data, capacity, headroom
+        nullptr, 0 // ext_data, ext_len
+    };
+    view.update_real_payload();
 }
 
-void ATPSocket::init_connection(OutgoingPacket * recv_pkt, bool active){
-    ATP_PROC_RESULT result = ATP_PROC_OK;
-    if (active)
+OutgoingPacket * ATPSocket::materialize_packet(OutgoingPacket * recv_pkt){
+    // Copy a packet view into the arena, so it can be cached in `inbuf`/`inbuf_cache2`
+    if (!recv_pkt->observer)
     {
-        switch_state(CS_CONNECTED);
-    }else{
-        switch_state(CS_SYN_RECV);
-    }
+        return recv_pkt;
+    }
+    OutgoingPacket * owned = context->packet_arena.fetch(recv_pkt->length);
+    std::memcpy(owned->data, recv_pkt->data, recv_pkt->length);
+    owned->marked = recv_pkt->marked;
+    owned->selective_acked = recv_pkt->selective_acked;
+    owned->ahead_handled = recv_pkt->ahead_handled;
+    owned->need_resend = recv_pkt->need_resend;
+    owned->length = recv_pkt->length;
+    owned->payload = recv_pkt->payload;
+    owned->option_len = recv_pkt->option_len;
+    owned->timestamp = recv_pkt->timestamp;
+    owned->transmissions = recv_pkt->transmissions;
+    owned->full_seq_nr = recv_pkt->full_seq_nr;
+    return owned;
+}
 
+void ATPSocket::init_connection(OutgoingPacket * recv_pkt, bool active){
+    ATP_PROC_RESULT result = ATP_PROC_OK;
     handle_recv_packet_hard(recv_pkt);
     handle_opt(recv_pkt);
     if(!active){
@@ -1528,6 +1787,14 @@ void ATPSocket::init_connection(OutgoingPacket * recv_pkt, bool active){
         }
     }
     do_ack_packet(recv_pkt);
+    // Switch state after `ack_nr` and `seq_nr` are set up, because
+    // switching state may wake up another thread(refer to `ATPBlockedSocket`) which sends data at once
+    if (active)
+    {
+        switch_state(CS_CONNECTED);
+    }else{
+        switch_state(CS_SYN_RECV);
+    }
 
     if (active)
     {
@@ -1561,7 +1828,10 @@ void ATPSocket::init_connection(OutgoingPacket * recv_pkt, bool active){
 }
 
 ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buffer, size_t len){
-    OutgoingPacket * recv_pkt = construct_packet_from_buffer(buffer, len);
+    OutgoingPacket recv_view;
+    view_packet_from_buffer(recv_view, buffer, len);
+    // `recv_pkt` is copied into the arena only if it is cached, so releasing it is no-op otherwise
+    OutgoingPacket * recv_pkt = &recv_view;
     const ATPPacket * pkt = recv_pkt->get_head();
 
     ATP_PROC_RESULT result = ATP_PROC_OK;
@@ -1585,7 +1855,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
             print_out(this, recv_pkt, "rcv-rst");
         #endif
 
-        delete recv_pkt;
+        context->packet_arena.release(recv_pkt);
         recv_pkt = nullptr;
         return ATP_PROC_OK;
     }
@@ -1610,7 +1880,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
                     result = send_packet(out_pkt);
                 }
             #endif
-            delete recv_pkt;
+            context->packet_arena.release(recv_pkt);
             recv_pkt = nullptr;
             return ATP_PROC_OK;
         }
@@ -1624,7 +1894,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
 
         init_connection(recv_pkt, true);
 
-        delete recv_pkt;
+        context->packet_arena.release(recv_pkt);
         recv_pkt = nullptr;
         return result;
 
@@ -1633,7 +1903,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
         // send the second handshake
         result = this->accept(addr, recv_pkt);
 
-        delete recv_pkt;
+        context->packet_arena.release(recv_pkt);
         recv_pkt = nullptr;
         return result;
     } 
@@ -1662,7 +1932,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
     {
         // Delete the previous last_handled_pkt
         if(last_handled_pkt)
-            delete last_handled_pkt;
+            context->packet_arena.release(last_handled_pkt);
         last_handled_pkt = recv_pkt;
     }
 
@@ -1685,7 +1955,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
             else if(result == ATP_PROC_OK)
             {
                 // delete the previous last_handled_pkt
-                delete last_handled_pkt;
+                context->packet_arena.release(last_handled_pkt);
                 last_handled_pkt = top_packet;
                 result = ATP_PROC_OK;
                 continue;
@@ -1700,7 +1970,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
             else if(result == ATP_PROC_FINISH)
             {
                 // Handled near the end of this function
-                delete last_handled_pkt;
+                context->packet_arena.release(last_handled_pkt);
                 last_handled_pkt = top_packet;
                 break;
             }
@@ -1717,7 +1987,7 @@ ATP_PROC_RESULT ATPSocket::process(const ATPAddrHandle & addr, const char * buff
         schedule_ack();
     }
     if(last_handled_pkt)
-        delete last_handled_pkt;
+        context->packet_arena.release(last_handled_pkt);
     if (result == ATP_PROC_FINISH)
     {
         if (conn_state == CS_DESTROY)
@@ -1865,7 +2135,7 @@ ATP_PROC_RESULT ATPSocket::do_selective_ack_packet(char * peer_sack_data, uint8_
     while(!outbuf.empty()){
         if (outbuf.back()->marked)
         {
-            delete outbuf.back();
+            context->packet_arena.release(outbuf.back());
             outbuf.pop_back();
         }else{
             break;
@@ -1876,8 +2146,9 @@ ATP_PROC_RESULT ATPSocket::do_selective_ack_packet(char * peer_sack_data, uint8_
     for (auto iter = outbuf.begin(); iter != outbuf.end(); iter++){
         if ((*iter) && (*iter)->marked)
         {
-            delete (*iter);
-            (*iter) = nullptr;
+            context->packet_arena.release((*iter));
+            // Also counted out of `outbuf.size()`, or the socket never finishes sending
+            outbuf.erase(iter.index);
         }
     }
     #endif
@@ -1940,31 +2211,58 @@ ATP_PROC_RESULT ATPSocket::do_ack_packet(OutgoingPacket * recv_pkt){
                     used_window -= out_pkt->payload;
                 }
             }
-            delete out_pkt;
+            context->packet_arena.release(out_pkt);
             out_pkt = nullptr;
         }else{
             // This packet is not Acked by peer yet, or it's SACKed by peer.
             break;
         }
     }
+    if (!zc_writes.empty())
+    {
+        complete_zc(false);
+    }
+}
+
+uint64_t ATPSocket::get_rto_min_us() const{
+    return rto_min_us != 0 ? rto_min_us : context->rto_min_us;
+}
+
+uint64_t ATPSocket::get_rto_max_us() const{
+    return rto_max_us != 0 ? rto_max_us : context->rto_max_us;
+}
+
+void ATPSocket::clamp_rto(){
+    // A socket's own bound may cross the context's changed later, then the min wins
+    uint64_t lo = get_rto_min_us();
+    rto_us = std::min(rto_us, std::max(get_rto_max_us(), lo));
+    rto_us = std::max(rto_us, lo);
 }
 
 void ATPSocket::update_rto(OutgoingPacket * recv_pkt){
     if (recv_pkt->transmissions == 1)
     {
         // We can only compute RTT of not re-transmited packet.
-        // This strategy is same as TCP's strategy.
-        static constexpr double alpha = 0.9;
-        uint64_t new_rtt = get_current_ms() - recv_pkt->timestamp;
-        this->rtt = static_cast<uint32_t>(alpha * rtt + (1 - alpha) * new_rtt);
-        uint32_t computed_rto = static_cast<uint32_t>(2 * this->rtt);
-        this->rto = computed_rto;
-        this->rto = std::max(this->rto, static_cast<uint32_t>(ATP_RTO_MIN));
-        this->rto = std::min(this->rto, static_cast<uint32_t>(ATP_RTO_MAX));
+        // This strategy is same as TCP's strategy(Karn's algorithm), and RTO is computed by RFC 6298.
+        uint64_t r = context->now_us() - recv_pkt->timestamp;
+        if (!rtt_measured)
+        {
+            rtt_measured = true;
+            srtt_us = r;
+            rttvar_us = r / 2;
+        } else {
+            uint64_t err = srtt_us > r ? srtt_us - r : r - srtt_us;
+            rttvar_us = (3 * rttvar_us + err) / 4;
+            srtt_us = (7 * srtt_us + r) / 8;
+        }
+        // The variance term is at least the clock granularity, which is a tick of the timer wheel
+        uint64_t computed_rto = srtt_us + std::max(static_cast<uint64_t>(ATP_TIMER_TICK_US), 4 * rttvar_us);
+        this->rto_us = computed_rto;
+        clamp_rto();
         #if defined (ATP_LOG_AT_DEBUG)
-            log_debug(this, "Computed new rtt:%u, rto:%u, choose rto:%u.", this->rtt, computed_rto, this->rto);
+            log_debug(this, "Computed new rtt:%lluus, srtt:%lluus, rttvar:%lluus, rto:%lluus, choose rto:%lluus."
+                , r, srtt_us, rttvar_us, computed_rto, rto_us);
         #endif
-        // printf("Computed new rtt:%u, rto:%u, choose rto:%u.\n", this->rtt, computed_rto, this->rto);
     }
 }
 
@@ -1977,6 +2275,8 @@ void ATPSocket::destroy_hard(){
     ATP_PROC_RESULT result = invoke_callback(ATP_CALL_ON_DESTROY, &arg);
     // Notify context
     context->destroyed_sockets.push_back(this);
+    // Wake up the user to clear it
+    context->request_timer_fd(context->now_us() / ATP_TIMER_TICK_US);
 }
 
 void ATPSocket::destroy(){
@@ -2007,9 +2307,9 @@ void ATPSocket::destroy(){
 }
 
 ATP_PROC_RESULT ATPSocket::check_timeout(){
-    uint64_t current_ms = get_current_ms();
+    uint64_t current_us = context->now_us();
     // Check delayed timeout
-    if (delay_ack_timeout != 0 && (current_ms > delay_ack_timeout))
+    if (delay_ack_timeout != 0 && (current_us > delay_ack_timeout))
     {
         // Delay ACK is enabled and timeout
         OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
@@ -2024,7 +2324,7 @@ ATP_PROC_RESULT ATPSocket::check_timeout(){
     {
         // If there is packet in outbuf
         // Check resend timeout
-        if (rto_timeout != 0 && (current_ms > rto_timeout))
+        if (rto_timeout != 0 && (current_us > rto_timeout))
         {
             #ifdef ATP_SHUTDOWN_SYN
             // SYN cookies shall be added then
@@ -2042,8 +2342,9 @@ ATP_PROC_RESULT ATPSocket::check_timeout(){
                 this->destroy();
                 return ATP_PROC_FINISH;
             }else{
-                this->rto *= 2;
-                this->rto = std::min(this->rto, static_cast<uint32_t>(ATP_RTO_MAX));
+                // Back off
+                this->rto_us *= 2;
+                clamp_rto();
                 #if defined (ATP_LOG_AT_DEBUG)
                     log_debug(this, "Retransmit all %u un-acked packet.", outbuf.size());
                 #endif
@@ -2081,16 +2382,16 @@ ATP_PROC_RESULT ATPSocket::check_timeout(){
         }
     }
     // Check persist timeout
-    if (persist_timeout != 0 && (current_ms > persist_timeout))
+    if (persist_timeout != 0 && (current_us > persist_timeout))
     {
         // Probing whether peer's window is still zero
     }
     if (conn_state == CS_TIME_WAIT)
     {
-        if ((int64_t)(current_ms - death_timeout) > 0 && death_timeout != 0)
+        if ((int64_t)(current_us - death_timeout) > 0 && death_timeout != 0)
         {
             #if defined (ATP_LOG_AT_DEBUG)
-                log_debug(this, "Death timeouted at %u %u .", death_timeout, current_ms);
+                log_debug(this, "Death timeouted at %llu %llu .", death_timeout, current_us);
             #endif
             switch_state(CS_DESTROY);
             this->destroy();
@@ -2111,7 +2412,7 @@ void ATPSocket::compute_clock_skew(){
         log_debug(this, "Initialize a clock skew probing.");
     #endif
     send_packet_noguard(out_pkt);
-    delete out_pkt;
+    context->packet_arena.release(out_pkt);
     out_pkt = nullptr;
 }
 
@@ -2133,7 +2434,7 @@ void ATPSocket::compute_clock_skew(const TimeDelayOption & delay_option){
         OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
         add_option(out_pkt, ATP_OPT_TIMESTAMP, sizeof(delay_option), reinterpret_cast<char*>(&delay_option));
         send_packet_noguard(out_pkt);
-        delete out_pkt;
+        context->packet_arena.release(out_pkt);
         out_pkt = nullptr;
     }else{
         // A received a responding packet from B back to A
@@ -2173,21 +2474,29 @@ void ATPSocket::update_window(uint16_t new_peer_window){
 }
 
 void ATPSocket::schedule_ack(){
-    if (ack_delayed_time != 0 && conn_state != CS_TIME_WAIT)
+    if (ack_delayed_us != 0 && conn_state != CS_TIME_WAIT)
     {
         // Delayed ACK is enabled
-        uint64_t current_ms = get_current_ms();
-        if (delay_ack_timeout == 0 || delay_ack_timeout < current_ms)
+        uint64_t current_us = context->now_us();
+        if (delay_ack_timeout == 0 || delay_ack_timeout < current_us)
         {
-            delay_ack_timeout = current_ms + ack_delayed_time;
+            delay_ack_timeout = current_us + ack_delayed_us;
+            arm_timer();
             #if defined (ATP_LOG_AT_DEBUG)
-                log_debug(this, "ACK packet scheduled at %llu, now %llu.", delay_ack_timeout, current_ms);
+                log_debug(this, "ACK packet scheduled at %llu, now %llu.", delay_ack_timeout, current_us);
             #endif
         }else{
             #if defined (ATP_LOG_AT_DEBUG)
-                log_debug(this, "ACK packet already scheduled at %llu after %llu, now %llu.", delay_ack_timeout - current_ms, delay_ack_timeout, current_ms);
+                log_debug(this, "ACK packet already scheduled at %llu after %llu, now %llu.", delay_ack_timeout - current_us, delay_ack_timeout, current_us);
             #endif
         }
+    }else if (context->burst_depth > 0){
+        // Delayed ACK is disabled, but we can still send one ACK for all packets of the burst
+        if (!burst_ack_pending)
+        {
+            burst_ack_pending = true;
+            context->burst_acks.push_back(this);
+        }
     }else{
         // Delayed ACK is disabled
         OutgoingPacket * out_pkt = basic_send_packet(ATPPacket::create_flags(PACKETFLAG_ACK));
@@ -22,8 +22,47 @@
 #include "udp_util.h"
 #include "atp_standalone.h"
 #include <functional>
+#include <vector>
 
 
+// Receive a datagram from `socket->sockfd` and process it, returns like `recvfrom`
+// `gro_cache` is sized on the first GRO read, and packets are parsed in place from it
+static int sys_recv(atp_socket * socket, char * sys_cache, std::vector<char> & gro_cache){
+    struct sockaddr_in peer_addr; socklen_t peer_len = sizeof(peer_addr);
+    sockaddr * ppeer_addr = (SA *)&peer_addr;
+    if (!socket->gro)
+    {
+        int n = recvfrom(socket->sockfd, sys_cache, ATP_SYSCACHE_MAX, 0, ppeer_addr, &peer_len);
+        if(n > 0){
+            #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
+                log_debug(socket, "sys_loop Recv %d bytes.", n);
+            #endif
+            ATPAddrHandle handle_to(reinterpret_cast<const SA *>(&peer_addr));
+            socket->process(handle_to, sys_cache, n);
+        }
+        return n;
+    }
+    // With UDP_GRO, packets of the flow may arrive coalesced, split them by the segment size
+    gro_cache.resize(ATP_GRO_CACHE_MAX);
+    size_t segment_size = 0;
+    int n = recvfrom_gro(socket->sockfd, gro_cache.data(), ATP_GRO_CACHE_MAX, 0, ppeer_addr, &peer_len, &segment_size);
+    if(n > 0){
+        #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
+            log_debug(socket, "sys_loop Recv %d bytes, segment size %u.", n, segment_size);
+        #endif
+        ATPAddrHandle handle_to(reinterpret_cast<const SA *>(&peer_addr));
+        if (segment_size == 0)
+        {
+            segment_size = n;
+        }
+        for (size_t offset = 0; offset < static_cast<size_t>(n); offset += segment_size)
+        {
+            socket->process(handle_to, gro_cache.data() + offset, std::min(segment_size, n - offset));
+        }
+    }
+    return n;
+}
+
 // #define ATP_USE_SIGALRM
 #ifdef ATP_USE_SIGALRM
 // make C happy
@@ -34,7 +73,9 @@ static void signal_entry(sigval_t sigval){
 
 static sigfunc_t * origin_sigfunc;
 static ATP_PROC_RESULT atp_sys_loop(atp_socket * socket, std::function<atp_result(atp_socket*)> predicate){ 
-    static char sys_cache[ATP_SYSCACHE_MAX];
+    // Every loop has its own buffers, so loops in different threads don't overwrite each other's packets
+    char sys_cache[ATP_SYSCACHE_MAX];
+    std::vector<char> gro_cache;
     if(socket == nullptr) return ATP_PROC_ERROR;
     // sys loop with blocked socket
     ATP_PROC_RESULT result;
@@ -62,9 +103,7 @@ static ATP_PROC_RESULT atp_sys_loop(atp_socket * socket, std::function<atp_resul
     alarm(1);
     // main loop
     while (true) {
-        struct sockaddr_in peer_addr; socklen_t peer_len = sizeof(peer_addr);
-        sockaddr * ppeer_addr = (SA *)&peer_addr;
-        int n = recvfrom(socket->sockfd, sys_cache, ATP_SYSCACHE_MAX, 0, ppeer_addr, &peer_len);
+        int n = sys_recv(socket, sys_cache, gro_cache);
         if (n < 0){
             if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN){
                 // normal, timeout
@@ -77,12 +116,6 @@ static ATP_PROC_RESULT atp_sys_loop(atp_socket * socket, std::function<atp_resul
                 result = ATP_PROC_ERROR;
                 break;
             }
-        }else{    
-            #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
-                log_debug(socket, "sys_loop Recv %d bytes.", n);
-            #endif
-            ATPAddrHandle handle_to(reinterpret_cast<const SA *>(&peer_addr));
-            socket->process(handle_to, sys_cache, n);
         }
         // TODO: here socket may be already deleted by context
         result = predicate(socket);
@@ -93,7 +126,9 @@ static ATP_PROC_RESULT atp_sys_loop(atp_socket * socket, std::function<atp_resul
 }
 #else
 static ATP_PROC_RESULT atp_sys_loop(atp_socket * socket, std::function<atp_result(atp_socket*)> predicate){ 
-    static char sys_cache[ATP_SYSCACHE_MAX];
+    // Every loop has its own buffers, so loops in different threads don't overwrite each other's packets
+    char sys_cache[ATP_SYSCACHE_MAX];
+    std::vector<char> gro_cache;
     if(socket == nullptr) return ATP_PROC_ERROR;
     // sys loop with blocked socket
     ATP_PROC_RESULT result;
@@ -115,15 +150,14 @@ static ATP_PROC_RESULT atp_sys_loop(atp_socket * socket, std::function<atp_resul
             if(result == ATP_PROC_FINISH) break;
         }
         else {
-            struct sockaddr_in peer_addr; socklen_t peer_len = sizeof(peer_addr);
-            sockaddr * ppeer_addr = (SA *)&peer_addr;
-            int n = recvfrom(socket->sockfd, sys_cache, ATP_SYSCACHE_MAX, 0, ppeer_addr, &peer_len);
-            if(n > 0){
-                #if defined (ATP_LOG_AT_DEBUG) && defined(ATP_LOG_UDP)
-                    log_debug(socket, "sys_loop Recv %d bytes.", n);
-                #endif
-                ATPAddrHandle handle_to(reinterpret_cast<const SA *>(&peer_addr));
-                socket->process(handle_to, sys_cache, n);
+            if (pfd[0].revents & POLLERR)
+            {
+                // Zero-copy completions are queued on the error queue, which is reported until drained
+                zerocopy_registry().reap(socket->sockfd);
+            }
+            if (pfd[0].revents & POLLIN)
+            {
+                sys_recv(socket, sys_cache, gro_cache);
             }
         }
 
@@ -21,23 +21,55 @@
 #include "atp_svc_impl.h"
 
 ATP_PROC_RESULT ATPContextServer::register_listen_port(ATPSocket * socket, uint16_t host_port) {
-    ATPContext::register_listen_port(socket, host_port);
-    ev.data.fd = socket->sockfd;
-    ev.events = EPOLLIN;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket->sockfd, &ev);
+    ATP_PROC_RESULT result = ATPContext::register_listen_port(socket, host_port);
+    if (result != ATP_PROC_OK) {
+        return result;
+    }
+    if (gro && !enable_udp_gro(socket->sockfd)) {
+        gro = false;
+    }
+    watch_fd(socket->sockfd);
+    return result;
 }
 
-void ATPContextServer::deregister_listen_port(uint16_t host_port) {
+void ATPContextServer::deregister_listen_port(ATPSocket * socket, uint16_t host_port) {
     std::map<uint16_t, ATPSocket *>::iterator iter = listen_sockets.find(host_port);
-    if (iter != listen_sockets.end()) {
-        listen_sockets.erase(iter);
+    if (iter != listen_sockets.end() && iter->second == socket) {
+        ATPContext::deregister_listen_port(socket, host_port);
+        // A listener which accepts a connection stops listening, but keeps receiving from its fd
+        if (!fd_in_use(socket->sockfd)) {
+            unwatch_fd(socket->sockfd);
+        }
+    }
+}
 
-        ev.data.fd = iter->second->sockfd;
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, iter->second->sockfd, &ev);
+void ATPContextServer::watch_fd(int sockfd) {
+    ev.data.fd = sockfd;
+    ev.events = EPOLLIN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev);
+}
+
+void ATPContextServer::unwatch_fd(int sockfd) {
+    ev.data.fd = sockfd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sockfd, &ev);
+}
+
+void ATPContextServer::attach_dedicated_fd(int sockfd) {
+    // Datagrams of a fd without UDP_GRO carry no GRO cmsg, and are processed as they are
+    if (gro) {
+        enable_udp_gro(sockfd);
     }
+    watch_fd(sockfd);
+}
+
+void ATPContextServer::detach_dedicated_fd(int sockfd) {
+    unwatch_fd(sockfd);
 }
 
 void ATPContextServer::init_server() {
+    // Users write to sockets from their own threads, while the server thread handles incoming packets
+    packet_arena.shared = true;
+    timer_wheel.shared = true;
     epoll_fd = epoll_create(event_size);
     events = new epoll_event[event_size];
 }
@@ -59,16 +91,110 @@ void ATPContextServer::destroy_server() {
 }
 
 ATP_PROC_RESULT ATPContextServer::daily_routine(){
-    ATPContext::daily_routine();
+    ATP_PROC_RESULT result = ATPContext::daily_routine();
     if (this->finished())
     {
         std::unique_lock<std::mutex> lk(this->mtx);
         this->cv.notify_all();
     }
+    return result;
+}
+
+void ATPContextServer::prepare_batch() {
+    size_t n = std::max<size_t>(recv_batch, 1);
+    if (batch_msgs.size() == n)
+    {
+        return;
+    }
+    batch_buffer.resize(n * ATP_SERVER_BUFFER_SIZE);
+    batch_msgs.resize(n);
+    batch_iovs.resize(n);
+    batch_addrs.resize(n);
+    batch_controls.resize(n * ATP_GRO_CONTROL_SIZE);
+    batch_datagrams.resize(n);
+    recv_histogram.resize(std::max(recv_histogram.size(), n + 1), 0);
+}
+
+bool ATPContextServer::enable_gro() {
+    bool ok = true;
+    for (std::map<uint16_t, ATPSocket *>::value_type & pr : listen_sockets)
+    {
+        if (pr.second->sockfd >= 0 && !enable_udp_gro(pr.second->sockfd))
+        {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+ATP_PROC_RESULT ATPContextServer::drain(int sockfd) {
+    prepare_batch();
+    size_t n = batch_msgs.size();
+    while (true) {
+        for (size_t i = 0; i < n; i++)
+        {
+            batch_iovs[i].iov_base = &batch_buffer[i * ATP_SERVER_BUFFER_SIZE];
+            batch_iovs[i].iov_len = ATP_SERVER_BUFFER_SIZE;
+            struct msghdr & hdr = batch_msgs[i].msg_hdr;
+            memset(&hdr, 0, sizeof hdr);
+            hdr.msg_name = &batch_addrs[i];
+            hdr.msg_namelen = sizeof(struct sockaddr_in);
+            hdr.msg_iov = &batch_iovs[i];
+            hdr.msg_iovlen = 1;
+            // Always ask for the cmsg, so fds with GRO enabled by `ATP_API_GRO` are split as well
+            hdr.msg_control = &batch_controls[i * ATP_GRO_CONTROL_SIZE];
+            hdr.msg_controllen = ATP_GRO_CONTROL_SIZE;
+        }
+        int got = recvmmsg(sockfd, batch_msgs.data(), n, MSG_DONTWAIT, nullptr);
+        syscalls++;
+        if (got <= 0)
+        {
+            // EAGAIN, or Socket Recv Error
+            return ATP_PROC_OK;
+        }
+        recv_calls++;
+        recv_datagrams += got;
+        recv_histogram[got]++;
+        size_t m = 0;
+        for (int i = 0; i < got; i++)
+        {
+            if (batch_msgs[i].msg_len == 0)
+            {
+                continue;
+            }
+            batch_datagrams[m].sockfd = sockfd;
+            batch_datagrams[m].buf = &batch_buffer[i * ATP_SERVER_BUFFER_SIZE];
+            batch_datagrams[m].len = batch_msgs[i].msg_len;
+            batch_datagrams[m].addr = (const SA *)&batch_addrs[i];
+            batch_datagrams[m].addr_len = batch_msgs[i].msg_hdr.msg_namelen;
+            size_t segment_size = gro_segment_size(&batch_msgs[i].msg_hdr);
+            batch_datagrams[m].segment_size = segment_size;
+            recv_packets += segment_size == 0 ? 1 : (batch_msgs[i].msg_len + segment_size - 1) / segment_size;
+            m++;
+        }
+        ATP_PROC_RESULT result = atp_process_udp_batch(this, batch_datagrams.data(), m);
+        if (result == ATP_PROC_FINISH) return ATP_PROC_FINISH;
+        if (static_cast<size_t>(got) < n)
+        {
+            // The queue is drained, don't wait for EAGAIN from another call
+            return ATP_PROC_OK;
+        }
+    }
 }
 
 ATP_PROC_RESULT ATPContextServer::main_loop() {
-    int nfds = epoll_wait(epoll_fd, events, event_size, timeout);
+    // Count `sendmmsg` calls made by the server thread in the last round
+    ATPTxQueue & queue = tx_queue();
+    syscalls += queue.sendmmsg_calls - counted_sendmmsg;
+    counted_sendmmsg = queue.sendmmsg_calls;
+    // `timeout` bounds the wait, so `finished` is still checked regularly
+    int wait_ms = atp_next_timeout(this);
+    if (wait_ms < 0 || wait_ms > timeout)
+    {
+        wait_ms = timeout;
+    }
+    int nfds = epoll_wait(epoll_fd, events, event_size, wait_ms);
+    syscalls++;
     if (nfds < 0) {
 
     } else if (nfds == 0) {
@@ -76,30 +202,26 @@ ATP_PROC_RESULT ATPContextServer::main_loop() {
     } else {
         for (int i = 0; i < nfds; ++i)
         {
+            if (events[i].events & EPOLLERR)
+            {
+                // Zero-copy completions are queued on the error queue, which is reported until drained
+                zerocopy_registry().reap(events[i].data.fd);
+                syscalls++;
+            }
             if (events[i].events & EPOLLIN)
             {
                 int sockfd = events[i].data.fd;
                 if (sockfd < 0)
                     continue;
-                int n;
-                struct sockaddr_in cli_addr; socklen_t cli_len = sizeof(cli_addr);
-                n = recvfrom(sockfd, buffer, ATP_SERVER_BUFFER_SIZE, 0, (SA *)&cli_addr, &cli_len);
-
-                if (n < 0)
-                {
-                    // Socket Recv Error
-                } else if (n == 0){
-                    // Socket Recv Error
-                } else {
-                    ATP_PROC_RESULT result = atp_process_udp(this, sockfd, buffer, n, (const SA *)&cli_addr, cli_len);
-                    if (result == ATP_PROC_FINISH) return ATP_PROC_FINISH;
-                }
+                if (drain(sockfd) == ATP_PROC_FINISH) return ATP_PROC_FINISH;
                 // Reset epoll events
                 ev.events = EPOLLIN;
                 int ans = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev);
+                syscalls++;
             }
         }
     }
+    return ATP_PROC_OK;
 }
 
 atp_context * atp_create_context_server() {
@@ -107,11 +229,65 @@ atp_context * atp_create_context_server() {
     return context;
 }
 
+atp_context * atp_create_context_server_backend(int backend) {
+    if (backend == ATP_SERVER_BACKEND_IO_URING)
+    {
+        ATPContextServer * context = create_uring_server();
+        if (context != nullptr)
+        {
+            return context;
+        }
+    }
+    return atp_create_context_server();
+}
+
 atp_socket * atp_fork_blocked_socket(atp_socket * origin){
     atp_context_server * con = dynamic_cast<atp_context_server *>(origin->context);
     return nullptr;
 }
 
+void atp_server_set_long(atp_context * context, size_t option, size_t value) {
+    atp_context_server * con = dynamic_cast<atp_context_server *>(context);
+    if (con == nullptr) return;
+    switch (option) {
+    case ATP_SERVER_API_RECV_BATCH:
+        con->recv_batch = std::max<size_t>(value, 1);
+        break;
+    case ATP_SERVER_API_GRO:
+        // Listening fds registered later are enabled by `register_listen_port`
+        con->gro = value && con->enable_gro();
+        break;
+    }
+}
+
+size_t atp_server_get_long(atp_context * context, size_t option) {
+    atp_context_server * con = dynamic_cast<atp_context_server *>(context);
+    if (con == nullptr) return 0;
+    switch (option) {
+    case ATP_SERVER_API_RECV_BATCH:
+        return con->recv_batch;
+    case ATP_SERVER_API_RECV_CALLS:
+        return con->recv_calls;
+    case ATP_SERVER_API_RECV_DATAGRAMS:
+        return con->recv_datagrams;
+    case ATP_SERVER_API_GRO:
+        return con->gro;
+    case ATP_SERVER_API_RECV_PACKETS:
+        return con->recv_packets;
+    case ATP_SERVER_API_BACKEND:
+        return con->backend;
+    case ATP_SERVER_API_SYSCALLS:
+        return con->syscalls;
+    }
+    return 0;
+}
+
+size_t atp_server_recv_histogram(atp_context * context, size_t n) {
+    atp_context_server * con = dynamic_cast<atp_context_server *>(context);
+    if (con == nullptr || n >= con->recv_histogram.size()) return 0;
+    return con->recv_histogram[n];
+}
+
 void atp_start_server(atp_context * context) {
     atp_context_server * con = dynamic_cast<atp_context_server *>(context);
     con->start_server();
@@ -138,7 +314,7 @@ atp_socket * atp_create_blocked_socket(atp_context * context) {
 
     atp_blocked_socket * socket = new ATPBlockedSocket(con);
     int sockfd = socket->init(AF_INET, SOCK_DGRAM, 0);
-    con->sockets.push_back(socket);
+    con->add_socket(socket);
 
     return socket;
 }
@@ -147,13 +323,11 @@ ATP_PROC_RESULT atp_blocked_connect(atp_socket * socket, const struct sockaddr *
     atp_blocked_socket * sock = dynamic_cast<atp_blocked_socket *>(socket);
     assert(sock != nullptr);
 
-    // Register sockfd to epoll manually is IMPORTANT.
+    // Register sockfd to the server manually is IMPORTANT.
     // In `atp_blocked_accept`, function `register_listen_port` will help you do that.
     atp_context_server * con = dynamic_cast<atp_context_server *>(sock->context);
     assert(con != nullptr);
-    con->ev.data.fd = socket->sockfd;
-    con->ev.events = EPOLLIN;
-    epoll_ctl(con->epoll_fd, EPOLL_CTL_ADD, socket->sockfd, &(con->ev));
+    con->watch_fd(socket->sockfd);
 
     ATPAddrHandle handle(to);
     sock->connect(to);
@@ -27,11 +27,48 @@ extern "C" {
 
 typedef struct ATPBlockedSocket atp_blocked_socket;
 typedef struct ATPContextServer atp_context_server;
+typedef struct ATPShardedServer atp_sharded_server;
+
+enum atp_server_api_options{
+    ATP_SERVER_API_RECV_BATCH, // Max datagrams received by one `recvmmsg`, ATP_SERVER_RECV_BATCH if not set
+    ATP_SERVER_API_RECV_CALLS, // Read-only, number of `recvmmsg` calls which returned datagrams
+    ATP_SERVER_API_RECV_DATAGRAMS, // Read-only, number of datagrams received
+    ATP_SERVER_API_GRO, // Enable UDP GRO on listening fds, so one datagram may carry many packets of a flow, 0 after set if not supported
+    ATP_SERVER_API_RECV_PACKETS, // Read-only, number of packets received, which exceeds datagrams when GRO coalesces them
+    ATP_SERVER_API_BACKEND, // Read-only, one of atp_server_backend
+    ATP_SERVER_API_SYSCALLS, // Read-only, number of syscalls made by the server thread to wait, receive and send
+};
+
+enum atp_server_backend{
+    ATP_SERVER_BACKEND_EPOLL, // epoll + recvmmsg + sendmmsg
+    ATP_SERVER_BACKEND_IO_URING, // Multishot recvmsg with a provided buffer ring, and sendmsg SQEs, refer to atp_svc_uring.cpp
+};
 
 atp_context * atp_create_context_server();
+// Create a server context using `backend`, falls back to ATP_SERVER_BACKEND_EPOLL if it is not available
+atp_context * atp_create_context_server_backend(int backend);
+void atp_server_set_long(atp_context * context, size_t option, size_t value);
+size_t atp_server_get_long(atp_context * context, size_t option);
+// Number of `recvmmsg` calls which returned exactly `n` datagrams
+size_t atp_server_recv_histogram(atp_context * context, size_t n);
 void atp_start_server(atp_context * context);
 void atp_wait_server(atp_context * context);
 
+// A sharded server runs `shards` server contexts, each with its own thread and its own SO_REUSEPORT fd of the same port.
+// Datagrams are steered by the kernel, so a connection is only handled by the thread of its shard. Refer to atp_svc_shard.cpp
+atp_sharded_server * atp_create_sharded_server(size_t shards, int backend);
+size_t atp_sharded_server_size(atp_sharded_server * server);
+atp_context * atp_sharded_server_context(atp_sharded_server * server, size_t shard);
+// Bind a listening socket of every shard to `port`, returns ATP_PROC_ERROR if any of them fails.
+// Set callbacks(such as ATP_CALL_ON_FORK) of the listening sockets before `atp_start_sharded_server`,
+// they are called by the thread of the shard. Their fds allow SO_REUSEPORT, so ATP_API_DEDICATED_FD can still be set.
+atp_result atp_sharded_listen(atp_sharded_server * server, uint16_t port);
+atp_socket * atp_sharded_server_listener(atp_sharded_server * server, size_t shard);
+// Whether datagrams are steered by `peer_sock_id`, otherwise by the kernel's hash of addresses, refer to `attach_steering`
+bool atp_sharded_server_steered(atp_sharded_server * server);
+void atp_start_sharded_server(atp_sharded_server * server);
+void atp_wait_sharded_server(atp_sharded_server * server);
+
 atp_socket * atp_fork_blocked_socket(atp_socket * origin);
 atp_socket * atp_create_blocked_socket(atp_context * context);
 
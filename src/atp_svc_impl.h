@@ -28,6 +28,7 @@
 
 #define ATP_SERVER_MAX_LISTEN 100
 #define ATP_SERVER_BUFFER_SIZE 65536
+#define ATP_SERVER_RECV_BATCH 16
 
 struct ATPContextServer : public ATPContext{
     ATPContextServer(){
@@ -36,26 +37,69 @@ struct ATPContextServer : public ATPContext{
 
     virtual ATP_PROC_RESULT daily_routine() override;
     virtual ATP_PROC_RESULT register_listen_port(ATPSocket * socket, uint16_t host_port) override;
-    virtual void deregister_listen_port(uint16_t host_port) override;
+    virtual void deregister_listen_port(ATPSocket * socket, uint16_t host_port) override;
 
-    ATP_PROC_RESULT main_loop();
+    // Wait for datagrams or the next timeout, and handle them. Returns ATP_PROC_FINISH to stop the server thread
+    virtual ATP_PROC_RESULT main_loop();
+    // Start/stop receiving datagrams from `sockfd`, may be called from any thread
+    virtual void watch_fd(int sockfd);
+    virtual void unwatch_fd(int sockfd);
+    virtual void attach_dedicated_fd(int sockfd) override;
+    virtual void detach_dedicated_fd(int sockfd) override;
+    // Receive all datagrams queued on `sockfd` by `recvmmsg`, and process them in bursts
+    ATP_PROC_RESULT drain(int sockfd);
+    // (Re)allocate buffers when `recv_batch` is changed
+    void prepare_batch();
+    // Enable GRO on all listening fds, returns false if any of them doesn't support it
+    bool enable_gro();
 
     void init_server();
     void start_server();
-    void destroy_server();
+    virtual void destroy_server();
 
 public:
     struct epoll_event * events;
     int event_size = ATP_SERVER_MAX_LISTEN, epoll_fd;
     int timeout = 500;
     struct epoll_event ev;
-    char buffer[ATP_SERVER_BUFFER_SIZE];
+    // Set before `atp_start_server`
+    size_t recv_batch = ATP_SERVER_RECV_BATCH;
+    // `recv_batch` datagrams of ATP_SERVER_BUFFER_SIZE bytes
+    std::vector<char> batch_buffer;
+    std::vector<struct mmsghdr> batch_msgs;
+    std::vector<struct iovec> batch_iovs;
+    std::vector<struct sockaddr_in> batch_addrs;
+    // ATP_GRO_CONTROL_SIZE bytes for each datagram, to receive its UDP_GRO segment size
+    std::vector<char> batch_controls;
+    std::vector<atp_datagram> batch_datagrams;
+    // recv_histogram[n] is the number of `recvmmsg` calls which returned n datagrams
+    std::vector<uint64_t> recv_histogram;
+    uint64_t recv_calls = 0;
+    uint64_t recv_datagrams = 0;
+    uint64_t recv_packets = 0;
+    bool gro = false;
+    int backend = ATP_SERVER_BACKEND_EPOLL;
+    // Syscalls made by the server thread, refer to ATP_SERVER_API_SYSCALLS
+    uint64_t syscalls = 0;
+    // `sendmmsg` calls of the server thread's `tx_queue()` already added to `syscalls`
+    uint64_t counted_sendmmsg = 0;
     std::thread ths;
     
     std::mutex mtx;
     std::condition_variable cv;
 };
 
+// Returns `nullptr` if io_uring is not built in or not supported by the kernel, refer to atp_svc_uring.cpp
+ATPContextServer * create_uring_server();
+
+// Shards share nothing but the port, refer to atp_svc_shard.cpp
+struct ATPShardedServer{
+    std::vector<ATPContextServer *> shards;
+    // The listening socket of every shard, whose fd is the shard's SO_REUSEPORT fd
+    std::vector<ATPSocket *> listeners;
+    bool steered = false;
+};
+
 struct ATPBlockedSocket : public ATPSocket{
     ATPBlockedSocket(ATPContext * context) : ATPSocket(context){
         
@@ -64,7 +108,7 @@ struct ATPBlockedSocket : public ATPSocket{
     virtual ATPSocket * fork_me() override{
         ATPSocket * socket = new ATPBlockedSocket(context);
         int sockfd = socket->init_fork(this);
-        context->sockets.push_back(socket);
+        context->add_socket(socket);
         return socket;
     }
 
@@ -74,6 +118,7 @@ struct ATPBlockedSocket : public ATPSocket{
         // For blocked read, refer to `atp_blocked_read`
         switch (new_state)
         {
+            case CS_SYN_RECV: // Connection accepted, refer to `atp_blocked_accept`
             case CS_CONNECTED: // Connection established
             case CS_PASSIVE_LISTEN: // Connection closed on a dominant socket
             case CS_DESTROY: // Connection closed on a non-dominant socket
@@ -0,0 +1,136 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "atp_svc_impl.h"
+#include <linux/filter.h>
+#include <cstddef>
+
+// A sharded server. Every shard is an ATPContextServer with its own thread, and its own SO_REUSEPORT fd of the same port.
+// The kernel steers every datagram to one fd of the reuseport group, so a connection is only handled by one thread,
+// and there's no lock shared by shards on the data path.
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+// Steering only looks at the low byte of a field, which ATP writes in host byte order
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ATP_LOW_BYTE_OFFSET(field) offsetof(CATPPacket, field)
+#else
+#define ATP_LOW_BYTE_OFFSET(field) (offsetof(CATPPacket, field) + 1)
+#endif
+
+// Attach a CBPF program to the reuseport group of `sockfd`, which returns the index of the fd in the group, i.e. the shard.
+// A packet goes to the shard of the low byte of its `peer_sock_id`, which is allocated by that shard, refer to `ATPContext::set_sock_id_shard`.
+// A SYN has no `peer_sock_id` yet, so it goes to the shard of the low byte of its random `seq_nr`, which is kept by re-sent SYNs.
+// With GRO, a coalesced datagram is steered by its first packet, so don't enable it if a peer fd multiplexes connections to different shards.
+static bool attach_steering(int sockfd, uint16_t shards){
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(CATPPacket, flags)),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, PACKETFLAG_SYN | PACKETFLAG_ACK),
+        // A SYN without ACK
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKETFLAG_SYN, 0, 2),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ATP_LOW_BYTE_OFFSET(seq_nr)),
+        BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ATP_LOW_BYTE_OFFSET(peer_sock_id)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof code / sizeof code[0];
+    prog.filter = code;
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == 0;
+}
+
+atp_sharded_server * atp_create_sharded_server(size_t shards, int backend){
+    // sock_ids of a shard are told by their low byte
+    shards = std::min<size_t>(std::max<size_t>(shards, 1), 256);
+    atp_sharded_server * server = new ATPShardedServer();
+    for(size_t i = 0; i < shards; i++){
+        ATPContextServer * con = dynamic_cast<ATPContextServer *>(atp_create_context_server_backend(backend));
+        con->set_sock_id_shard(i, shards);
+        server->shards.push_back(con);
+    }
+    return server;
+}
+
+size_t atp_sharded_server_size(atp_sharded_server * server){
+    return server == nullptr ? 0 : server->shards.size();
+}
+
+atp_context * atp_sharded_server_context(atp_sharded_server * server, size_t shard){
+    if (server == nullptr || shard >= server->shards.size()) return nullptr;
+    return server->shards[shard];
+}
+
+atp_result atp_sharded_listen(atp_sharded_server * server, uint16_t port){
+    if (server == nullptr || !server->listeners.empty()) return ATP_PROC_ERROR;
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    for(ATPContextServer * con : server->shards){
+        atp_socket * socket = atp_create_blocked_socket(con);
+        int on = 1;
+        // The index of a fd in the reuseport group is the order it is bound, so it is the shard.
+        // Another fd joining the group(from any process of the same user) breaks the order.
+        if (setsockopt(socket->sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0
+            || bind(socket->sockfd, reinterpret_cast<const struct sockaddr *>(&addr), sizeof addr) < 0)
+        {
+            #if defined (ATP_LOG_AT_DEBUG)
+                log_debug(socket, "Can't bind shard fd %d to port %u.", socket->sockfd, port);
+            #endif
+            return ATP_PROC_ERROR;
+        }
+        // Keep listening, and fork a socket for every further connection, refer to `ATPSocket::accept`
+        socket->reuse_port_flag = true;
+        if (atp_listen(socket, port) != ATP_PROC_OK)
+        {
+            return ATP_PROC_ERROR;
+        }
+        server->listeners.push_back(socket);
+    }
+    // Otherwise the kernel hashes the addresses of a datagram, which also keeps a connection on one shard,
+    // as long as the peer doesn't change its address
+    server->steered = attach_steering(server->listeners[0]->sockfd, server->shards.size());
+    return ATP_PROC_OK;
+}
+
+atp_socket * atp_sharded_server_listener(atp_sharded_server * server, size_t shard){
+    if (server == nullptr || shard >= server->listeners.size()) return nullptr;
+    return server->listeners[shard];
+}
+
+bool atp_sharded_server_steered(atp_sharded_server * server){
+    return server != nullptr && server->steered;
+}
+
+void atp_start_sharded_server(atp_sharded_server * server){
+    for(ATPContextServer * con : server->shards){
+        con->start_server();
+    }
+}
+
+void atp_wait_sharded_server(atp_sharded_server * server){
+    for(ATPContextServer * con : server->shards){
+        atp_wait_server(con);
+    }
+}
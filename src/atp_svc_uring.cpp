@@ -0,0 +1,567 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "atp_svc_impl.h"
+
+// The io_uring backend of ATPContextServer, driven by raw syscalls, so there's no dependency on liburing.
+// Define ATP_NO_IO_URING to leave it out, then `create_uring_server` always returns `nullptr`.
+#if !defined(ATP_NO_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ATP_HAS_IO_URING
+#endif
+
+#if defined (ATP_HAS_IO_URING)
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
+#include <set>
+
+#define ATP_URING_ENTRIES 256
+#define ATP_URING_CQ_ENTRIES 4096
+// Number of buffers in the provided buffer ring, must be a power of 2
+#define ATP_URING_BUFFERS 64
+#define ATP_URING_BUFFER_GROUP 0
+
+// The high 32 bits of `user_data` is the operation, and the low 32 bits is the fd, or the sequence of a timeout
+enum ATP_URING_OP_ENUM{
+    URING_OP_RECV = 1,
+    URING_OP_SEND,
+    URING_OP_SEND_GSO,
+    URING_OP_TIMEOUT,
+    URING_OP_WAKE,
+    URING_OP_CANCEL,
+};
+
+static inline uint64_t make_user_data(uint64_t op, uint32_t low){
+    return (op << 32) | low;
+}
+
+// Mapped rings of an io_uring instance
+struct ATPUring{
+    ~ATPUring(){
+        destroy();
+    }
+    bool init(unsigned entries, unsigned cq_entries){
+        struct io_uring_params p;
+        std::memset(&p, 0, sizeof p);
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries = cq_entries;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring_fd < 0)
+        {
+            return false;
+        }
+        features = p.features;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            return false;
+        }
+        if (single_mmap)
+        {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+            {
+                return false;
+            }
+        }
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        void * sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes = reinterpret_cast<struct io_uring_sqe *>(sqes_ptr);
+        char * sq = reinterpret_cast<char *>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        sq_entries = p.sq_entries;
+        char * cq = reinterpret_cast<char *>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+        return true;
+    }
+    void destroy(){
+        if (sqes != nullptr)
+        {
+            munmap(sqes, sqes_size);
+            sqes = nullptr;
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != MAP_FAILED)
+        {
+            munmap(sq_ptr, sq_size);
+        }
+        sq_ptr = cq_ptr = MAP_FAILED;
+        if (ring_fd >= 0)
+        {
+            close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags){
+        int r = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        if (r > 0)
+        {
+            unsubmitted -= std::min<unsigned>(r, unsubmitted);
+        }
+        return r;
+    }
+    // Submit prepared SQEs
+    int submit(){
+        if (unsubmitted == 0)
+        {
+            return 0;
+        }
+        submits++;
+        return enter(unsubmitted, 0, 0);
+    }
+    // Get a cleared SQE, which is submitted by the next `enter`.
+    // Without SQPOLL, the kernel reads SQEs only in `io_uring_enter`, so the tail is published at once.
+    struct io_uring_sqe * get_sqe(){
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        {
+            submit();
+        }
+        unsigned index = tail & sq_mask;
+        struct io_uring_sqe * sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof *sqe);
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        return sqe;
+    }
+
+    int ring_fd = -1;
+    unsigned features = 0;
+    void * sq_ptr = MAP_FAILED;
+    void * cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    struct io_uring_sqe * sqes = nullptr;
+    unsigned * sq_head, * sq_tail, * sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned * cq_head, * cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe * cqes;
+    unsigned unsubmitted = 0;
+    // `enter` calls made by `submit`, the others are counted by the caller
+    uint64_t submits = 0;
+};
+
+// Datagrams are received by a multishot `recvmsg` per fd, into buffers picked by the kernel from a provided buffer ring.
+// Datagrams sent by the server thread are queued by `ATPTxQueue` as usual, and submitted as `sendmsg` SQEs in one `io_uring_enter`.
+// The wait is bounded by a timeout SQE, which is armed to the next ATP timeout.
+struct ATPContextServerUring : public ATPContextServer, public ATPTxSender{
+    bool init_uring(){
+        backend = ATP_SERVER_BACKEND_IO_URING;
+        if (!ring.init(ATP_URING_ENTRIES, ATP_URING_CQ_ENTRIES))
+        {
+            return false;
+        }
+        // A buffer holds `io_uring_recvmsg_out`, the address, the cmsg of UDP GRO, and the datagram
+        buffer_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + ATP_GRO_CONTROL_SIZE + ATP_SERVER_BUFFER_SIZE;
+        buffers.resize(ATP_URING_BUFFERS * buffer_size);
+        buf_ring_size = ATP_URING_BUFFERS * sizeof(struct io_uring_buf);
+        void * ptr = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            return false;
+        }
+        buf_ring = reinterpret_cast<struct io_uring_buf_ring *>(ptr);
+        struct io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof reg);
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+        reg.ring_entries = ATP_URING_BUFFERS;
+        reg.bgid = ATP_URING_BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, ring.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            return false;
+        }
+        for (unsigned bid = 0; bid < ATP_URING_BUFFERS; bid++)
+        {
+            recycled.push_back(bid);
+        }
+        recycle_buffers();
+
+        std::memset(&recv_template, 0, sizeof recv_template);
+        recv_template.msg_namelen = sizeof(struct sockaddr_in);
+        recv_template.msg_controllen = ATP_GRO_CONTROL_SIZE;
+
+        // Blocking, so io_uring polls it rather than completing the read with EAGAIN
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0)
+        {
+            return false;
+        }
+        arm_wake();
+        return true;
+    }
+
+    virtual void destroy_server() override{
+        // Called by `atp_wait_server` once the context is finished, while the server thread may still be in `main_loop`
+        std::lock_guard<std::mutex> lk(loop_mtx);
+        stopped = true;
+        ATPContextServer::destroy_server();
+        ring.destroy();
+        if (buf_ring != nullptr)
+        {
+            munmap(buf_ring, buf_ring_size);
+            buf_ring = nullptr;
+        }
+        if (wake_fd >= 0)
+        {
+            close(wake_fd);
+            wake_fd = -1;
+        }
+    }
+
+    virtual void watch_fd(int sockfd) override{
+        request(sockfd, true);
+    }
+    virtual void unwatch_fd(int sockfd) override{
+        request(sockfd, false);
+    }
+
+    // The ring is only touched by the server thread, so other threads queue their requests and wake it
+    void request(int sockfd, bool watch){
+        {
+            std::lock_guard<std::mutex> lk(requests_mtx);
+            requests.push_back(std::make_pair(sockfd, watch));
+        }
+        uint64_t one = 1;
+        // A full counter still wakes the ring, nothing to do on failure
+        (void)write(wake_fd, &one, sizeof one);
+    }
+
+    void apply_requests(){
+        std::vector<std::pair<int, bool>> pending;
+        {
+            std::lock_guard<std::mutex> lk(requests_mtx);
+            pending.swap(requests);
+        }
+        for (std::pair<int, bool> & pr : pending)
+        {
+            if (pr.second)
+            {
+                if (watched.insert(pr.first).second)
+                {
+                    arm_recv(pr.first);
+                }
+            } else if (watched.count(pr.first) > 0 && !fd_in_use(pr.first)) {
+                watched.erase(pr.first);
+                struct io_uring_sqe * sqe = ring.get_sqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = make_user_data(URING_OP_RECV, pr.first);
+                sqe->user_data = make_user_data(URING_OP_CANCEL, pr.first);
+            }
+        }
+    }
+
+    void arm_recv(int sockfd){
+        struct io_uring_sqe * sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = sockfd;
+        sqe->addr = reinterpret_cast<uint64_t>(&recv_template);
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = ATP_URING_BUFFER_GROUP;
+        sqe->user_data = make_user_data(URING_OP_RECV, sockfd);
+    }
+
+    void arm_wake(){
+        struct io_uring_sqe * sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+        sqe->len = sizeof wake_value;
+        sqe->user_data = make_user_data(URING_OP_WAKE, 0);
+    }
+
+    // Arm a timeout SQE `after_us` later, unless an earlier one is pending.
+    // A superseded timeout still completes, but it is recognized by its sequence and ignored.
+    void arm_timeout(int64_t after_us){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t deadline_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec + after_us * 1000;
+        if (timeout_pending && timeout_deadline_ns <= deadline_ns)
+        {
+            return;
+        }
+        timeout_seq++;
+        timeout_pending = true;
+        timeout_deadline_ns = deadline_ns;
+        // Read when the SQE is submitted, which is before the next `arm_timeout`
+        timeout_ts.tv_sec = after_us / 1000000;
+        timeout_ts.tv_nsec = (after_us % 1000000) * 1000;
+        struct io_uring_sqe * sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&timeout_ts);
+        sqe->len = 1;
+        sqe->user_data = make_user_data(URING_OP_TIMEOUT, timeout_seq);
+    }
+
+    void recycle_buffers(){
+        unsigned short tail = buf_ring->tail;
+        // Not `buf_ring->bufs`, whose flexible array is declared after an empty struct, which takes 1 byte in C++.
+        // The entries start at the beginning of the ring, and the first one overlaps `tail`
+        struct io_uring_buf * bufs = reinterpret_cast<struct io_uring_buf *>(buf_ring);
+        for (size_t i = 0; i < recycled.size(); i++)
+        {
+            struct io_uring_buf * buf = &bufs[(tail + i) & (ATP_URING_BUFFERS - 1)];
+            buf->addr = reinterpret_cast<uint64_t>(&buffers[recycled[i] * buffer_size]);
+            buf->len = buffer_size;
+            buf->bid = recycled[i];
+        }
+        __atomic_store_n(&buf_ring->tail, static_cast<unsigned short>(tail + recycled.size()), __ATOMIC_RELEASE);
+        recycled.clear();
+    }
+
+    void handle_recv(int sockfd, const struct io_uring_cqe * cqe){
+        if (!(cqe->flags & IORING_CQE_F_MORE) && watched.count(sockfd) > 0)
+        {
+            if (cqe->res >= 0 || cqe->res == -ENOBUFS)
+            {
+                // The multishot request ended(such as running out of buffers), re-arm it after buffers are recycled
+                rearm.push_back(sockfd);
+            } else {
+                // Such as the fd is closed
+                watched.erase(sockfd);
+            }
+        }
+        if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        {
+            return;
+        }
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        // Returned to the kernel after the burst, when no packet refers to it
+        recycled.push_back(bid);
+        if (cqe->res < 0)
+        {
+            return;
+        }
+        char * buf = &buffers[bid * buffer_size];
+        const struct io_uring_recvmsg_out * out = reinterpret_cast<const struct io_uring_recvmsg_out *>(buf);
+        if (out->flags & MSG_TRUNC)
+        {
+            return;
+        }
+        char * name = buf + sizeof(struct io_uring_recvmsg_out);
+        char * control = name + recv_template.msg_namelen;
+        char * payload = control + recv_template.msg_controllen;
+        struct msghdr hdr;
+        std::memset(&hdr, 0, sizeof hdr);
+        hdr.msg_control = control;
+        hdr.msg_controllen = out->controllen;
+        size_t segment_size = gro_segment_size(&hdr);
+        recv_datagrams++;
+        recv_packets += segment_size == 0 ? 1 : (out->payloadlen + segment_size - 1) / segment_size;
+        atp_process_udp_gro(this, sockfd, payload, out->payloadlen, segment_size, reinterpret_cast<const SA *>(name)
+            , std::min<socklen_t>(out->namelen, recv_template.msg_namelen));
+    }
+
+    // Handle all completions in a burst
+    ATP_PROC_RESULT reap(){
+        atp_begin_burst(this);
+        unsigned head = *ring.cq_head;
+        while (true)
+        {
+            unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                break;
+            }
+            for (; head != tail; head++)
+            {
+                const struct io_uring_cqe * cqe = &ring.cqes[head & ring.cq_mask];
+                uint32_t low = static_cast<uint32_t>(cqe->user_data);
+                switch (cqe->user_data >> 32)
+                {
+                case URING_OP_RECV:
+                    handle_recv(static_cast<int>(low), cqe);
+                    break;
+                case URING_OP_SEND_GSO:
+                    if (cqe->res == -EIO || cqe->res == -EINVAL || cqe->res == -ENOPROTOOPT || cqe->res == -EOPNOTSUPP)
+                    {
+                        // The datagram is dropped, and sent again without GSO by retransmission
+                        tx_queue().gso_supported = false;
+                    }
+                    break;
+                case URING_OP_TIMEOUT:
+                    if (low == timeout_seq)
+                    {
+                        timeout_pending = false;
+                    }
+                    break;
+                case URING_OP_WAKE:
+                    apply_requests();
+                    arm_wake();
+                    break;
+                }
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+        ATP_PROC_RESULT result = atp_end_burst(this);
+        recycle_buffers();
+        for (int sockfd : rearm)
+        {
+            arm_recv(sockfd);
+        }
+        rearm.clear();
+        return result;
+    }
+
+    virtual ATP_PROC_RESULT main_loop() override{
+        std::lock_guard<std::mutex> lk(loop_mtx);
+        ATPTxQueue & queue = tx_queue();
+        if (stopped)
+        {
+            queue.sender = nullptr;
+            return ATP_PROC_FINISH;
+        }
+        queue.sender = this;
+        // `timeout` bounds the wait, so `finished` is still checked regularly
+        int64_t after_us = atp_next_timeout_us(this);
+        if (after_us < 0 || after_us > timeout * 1000)
+        {
+            after_us = timeout * 1000;
+        }
+        arm_timeout(after_us);
+        ring.enter(ring.unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        syscalls++;
+        ATP_PROC_RESULT result = reap();
+        // Submitted by the next `enter`
+        syscalls += ring.submits;
+        ring.submits = 0;
+        if (result == ATP_PROC_FINISH)
+        {
+            queue.sender = nullptr;
+        }
+        return result;
+    }
+
+    virtual int send_msgs(int sockfd, struct mmsghdr * msgs, unsigned int n) override{
+        bool skip_success = ring.features & IORING_FEAT_CQE_SKIP;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            struct io_uring_sqe * sqe = ring.get_sqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = sockfd;
+            sqe->addr = reinterpret_cast<uint64_t>(&msgs[i].msg_hdr);
+            sqe->len = 1;
+            // Fail rather than wait for buffer space, so the send is done within `commit`
+            sqe->msg_flags = MSG_DONTWAIT;
+            if (skip_success)
+            {
+                // Only failures are reported
+                sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            }
+            sqe->user_data = make_user_data(msgs[i].msg_hdr.msg_control != nullptr ? URING_OP_SEND_GSO : URING_OP_SEND, sockfd);
+        }
+        return n;
+    }
+
+    virtual void commit() override{
+        // `sendmsg` SQEs are issued inline by `io_uring_enter`, so the messages and data can be released when it returns
+        ring.submit();
+    }
+
+    ATPUring ring;
+    size_t buffer_size = 0;
+    std::vector<char> buffers;
+    struct io_uring_buf_ring * buf_ring = nullptr;
+    size_t buf_ring_size = 0;
+    // Buffer ids to give back to the kernel, and fds whose multishot `recvmsg` should be re-armed
+    std::vector<uint16_t> recycled;
+    std::vector<int> rearm;
+    struct msghdr recv_template;
+    struct __kernel_timespec timeout_ts;
+    uint32_t timeout_seq = 0;
+    bool timeout_pending = false;
+    uint64_t timeout_deadline_ns = 0;
+    // fds with a multishot `recvmsg`, only accessed by the server thread
+    std::set<int> watched;
+    int wake_fd = -1;
+    uint64_t wake_value = 0;
+    std::mutex requests_mtx;
+    std::vector<std::pair<int, bool>> requests;
+    // Held by `main_loop`, so `destroy_server` doesn't release the ring under it
+    std::mutex loop_mtx;
+    bool stopped = false;
+};
+
+// Multishot `recvmsg` requires Linux 6.0
+static bool kernel_supports_uring(){
+    struct utsname name;
+    if (uname(&name) < 0)
+    {
+        return false;
+    }
+    int major = 0, minor = 0;
+    sscanf(name.release, "%d.%d", &major, &minor);
+    return major >= 6;
+}
+
+ATPContextServer * create_uring_server(){
+    if (!kernel_supports_uring())
+    {
+        return nullptr;
+    }
+    ATPContextServerUring * context = new ATPContextServerUring();
+    if (!context->init_uring())
+    {
+        #if defined (ATP_LOG_AT_DEBUG)
+            log_debug(context, "io_uring is not available, errno %d.", errno);
+        #endif
+        context->destroy_server();
+        delete context;
+        return nullptr;
+    }
+    return context;
+}
+
+#else
+
+ATPContextServer * create_uring_server(){
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,278 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "atp_impl.h"
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+ATPTimerWheel::ATPTimerWheel(){
+    init(0);
+}
+
+void ATPTimerWheel::init(uint64_t now){
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    for(auto & level : slots){
+        for(ATPTimerNode & head : level){
+            head.prev = head.next = &head;
+        }
+    }
+    current = now;
+    count = 0;
+}
+
+void ATPTimerWheel::link(ATPTimerNode * node){
+    // Deadlines in the past are due at the next tick
+    uint64_t expire = std::max(node->expire, current);
+    uint64_t delta = expire - current;
+    size_t level = 0;
+    while(level + 1 < ATP_TIMER_WHEEL_LEVELS && delta >= (static_cast<uint64_t>(1) << ((level + 1) * ATP_TIMER_WHEEL_BITS))){
+        level++;
+    }
+    if (delta >= (static_cast<uint64_t>(1) << (ATP_TIMER_WHEEL_LEVELS * ATP_TIMER_WHEEL_BITS)))
+    {
+        // Too far away, put it in the farthest slot, and it will be re-scheduled when cascaded
+        expire = current + (static_cast<uint64_t>(1) << (ATP_TIMER_WHEEL_LEVELS * ATP_TIMER_WHEEL_BITS)) - 1;
+    }
+    ATPTimerNode * head = &slots[level][(expire >> (level * ATP_TIMER_WHEEL_BITS)) & (ATP_TIMER_WHEEL_SLOTS - 1)];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    count++;
+}
+
+void ATPTimerWheel::unlink(ATPTimerNode * node){
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    count--;
+}
+
+void ATPTimerWheel::schedule(ATPTimerNode * node, uint64_t expire){
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    if (node->linked())
+    {
+        if (node->expire == expire)
+        {
+            return;
+        }
+        unlink(node);
+    }
+    node->expire = expire;
+    link(node);
+}
+
+void ATPTimerWheel::cancel(ATPTimerNode * node){
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    if (node->linked())
+    {
+        unlink(node);
+    }
+}
+
+void ATPTimerWheel::advance(uint64_t now, std::vector<ATPSocket *> & due){
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    while(current <= now){
+        if (count == 0)
+        {
+            // Nothing to cascade, jump directly
+            current = now + 1;
+            break;
+        }
+        size_t index = current & (ATP_TIMER_WHEEL_SLOTS - 1);
+        if (index == 0)
+        {
+            // Level 0 wraps around, move the deadlines in the next slot of upper levels down
+            for(size_t level = 1; level < ATP_TIMER_WHEEL_LEVELS; level++){
+                size_t upper_index = (current >> (level * ATP_TIMER_WHEEL_BITS)) & (ATP_TIMER_WHEEL_SLOTS - 1);
+                ATPTimerNode * head = &slots[level][upper_index];
+                while(head->next != head){
+                    ATPTimerNode * node = head->next;
+                    unlink(node);
+                    link(node);
+                }
+                if (upper_index != 0)
+                {
+                    break;
+                }
+            }
+        }
+        ATPTimerNode * head = &slots[0][index];
+        while(head->next != head){
+            ATPTimerNode * node = head->next;
+            unlink(node);
+            due.push_back(node->owner);
+        }
+        current++;
+    }
+}
+
+bool ATPTimerWheel::next_expire(uint64_t & expire){
+    std::unique_lock<std::mutex> lk(mtx, std::defer_lock);
+    if(shared) lk.lock();
+    if (count == 0)
+    {
+        return false;
+    }
+    bool found = false;
+    auto earlier = [&expire, &found](uint64_t t){
+        if (!found || t < expire)
+        {
+            expire = t;
+            found = true;
+        }
+    };
+    // Level 0 slots are exact ticks, the first non-empty slot from `current` is the earliest of level 0
+    size_t index = current & (ATP_TIMER_WHEEL_SLOTS - 1);
+    for(size_t i = 0; i < ATP_TIMER_WHEEL_SLOTS; i++){
+        size_t slot = (index + i) & (ATP_TIMER_WHEEL_SLOTS - 1);
+        if (slots[0][slot].next != &slots[0][slot])
+        {
+            earlier(current + i);
+            break;
+        }
+    }
+    // A slot of upper levels covers a range of ticks, so look into its nodes.
+    // The slot of `current` may hold deadlines not cascaded yet, or deadlines a whole round later,
+    // so check it together with the first non-empty slot after it
+    for(size_t level = 1; level < ATP_TIMER_WHEEL_LEVELS; level++){
+        size_t upper_index = (current >> (level * ATP_TIMER_WHEEL_BITS)) & (ATP_TIMER_WHEEL_SLOTS - 1);
+        for(size_t i = 0; i < ATP_TIMER_WHEEL_SLOTS; i++){
+            ATPTimerNode * head = &slots[level][(upper_index + i) & (ATP_TIMER_WHEEL_SLOTS - 1)];
+            for(ATPTimerNode * node = head->next; node != head; node = node->next){
+                earlier(std::max(node->expire, current));
+            }
+            if (i > 0 && head->next != head)
+            {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+int64_t ATPContext::next_timeout_us(){
+    if (!destroyed_sockets.empty() || !burst_acks.empty())
+    {
+        // `daily_routine` has something to do right now
+        return 0;
+    }
+    uint64_t tick;
+    if (!timer_wheel.next_expire(tick))
+    {
+        return -1;
+    }
+    uint64_t deadline = tick * ATP_TIMER_TICK_US;
+    uint64_t current_us = now_us();
+    return deadline > current_us ? static_cast<int64_t>(deadline - current_us) : 0;
+}
+
+int ATPContext::get_timer_fd(){
+    if (timer_fd < 0)
+    {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0)
+        {
+            return -1;
+        }
+        timer_fd_tick = 0;
+        update_timer_fd();
+    }
+    return timer_fd;
+}
+
+static void set_timer_fd(int fd, uint64_t after_us){
+    struct itimerspec its = {};
+    // A zero `it_value` disarms the timer, so a due deadline is armed to 1ns
+    its.it_value.tv_sec = after_us / 1000000;
+    its.it_value.tv_nsec = (after_us % 1000000) * 1000;
+    if (after_us == 0)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(fd, 0, &its, nullptr);
+}
+
+void ATPContext::request_timer_fd(uint64_t tick){
+    if (timer_fd < 0 || (timer_fd_tick != 0 && timer_fd_tick <= tick))
+    {
+        return;
+    }
+    timer_fd_tick = tick;
+    // Relative time is used, because the clock of the context may not be CLOCK_MONOTONIC
+    uint64_t deadline = tick * ATP_TIMER_TICK_US;
+    uint64_t current_us = now_us();
+    set_timer_fd(timer_fd, deadline > current_us ? deadline - current_us : 0);
+}
+
+void ATPContext::update_timer_fd(){
+    if (timer_fd < 0)
+    {
+        return;
+    }
+    int64_t after_us = next_timeout_us();
+    if (after_us < 0)
+    {
+        struct itimerspec its = {};
+        timerfd_settime(timer_fd, 0, &its, nullptr);
+        timer_fd_tick = 0;
+    } else {
+        set_timer_fd(timer_fd, after_us);
+        timer_fd_tick = (now_us() + after_us) / ATP_TIMER_TICK_US;
+        if (timer_fd_tick == 0)
+        {
+            timer_fd_tick = 1;
+        }
+    }
+}
+
+void ATPSocket::arm_timer(){
+    uint64_t next = 0;
+    auto earlier = [&next](uint64_t t){
+        if (t != 0 && (next == 0 || t < next))
+        {
+            next = t;
+        }
+    };
+    // Consider the same timeouts as `check_timeout` does
+    earlier(delay_ack_timeout);
+    if (!outbuf.empty())
+    {
+        earlier(rto_timeout);
+    }
+    earlier(persist_timeout);
+    if (conn_state == CS_TIME_WAIT)
+    {
+        earlier(death_timeout);
+    }
+    if (next == 0)
+    {
+        context->timer_wheel.cancel(&timer_node);
+    } else {
+        // `check_timeout` handles a timeout when current time is greater than it,
+        // round up so the socket is never checked too early
+        uint64_t tick = (next + ATP_TIMER_TICK_US) / ATP_TIMER_TICK_US;
+        context->timer_wheel.schedule(&timer_node, tick);
+        context->request_timer_fd(tick);
+    }
+}
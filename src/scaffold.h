@@ -30,34 +30,363 @@
 #include <climits>
 #include <cassert>
 #include <iterator>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
 
+// A list shared by all threads, which holds objects overflowed from thread-local `TPool`s.
+template<typename T>
+struct TPoolDepot{
+    // Move at most `n` objects from the back of `from`, returns how many are moved
+    size_t put(std::vector<T *> & from, size_t n){
+        std::lock_guard<std::mutex> lk(mtx);
+        size_t moved = 0;
+        while(moved < n && !from.empty() && cached.size() < capacity){
+            cached.push_back(from.back());
+            from.pop_back();
+            moved++;
+        }
+        return moved;
+    }
+    // Move at most `n` objects to `to`, returns how many are moved
+    size_t take(std::vector<T *> & to, size_t n){
+        std::lock_guard<std::mutex> lk(mtx);
+        size_t moved = 0;
+        while(moved < n && !cached.empty()){
+            to.push_back(cached.back());
+            cached.pop_back();
+            moved++;
+        }
+        return moved;
+    }
+    size_t size(){
+        std::lock_guard<std::mutex> lk(mtx);
+        return cached.size();
+    }
+    TPoolDepot(size_t cap, std::function<void(T*)> destroyer) : capacity(cap), destroy(destroyer){
+
+    }
+    ~TPoolDepot(){
+        for(T * x : cached){
+            destroy(x);
+        }
+    }
+protected:
+    size_t capacity;
+    std::function<void(T*)> destroy;
+    std::vector<T *> cached;
+    std::mutex mtx;
+};
+
+// A pool which is not thread-safe, so it is usually declared `thread_local`.
+// When there are more than `high_watermark` cached objects, the pool shrinks to `low_watermark`,
+// the overflowed objects go to `depot` if there is one, and are destroyed if `depot` is full.
+// When the pool is empty, it refills from `depot` first.
 template<typename T>
 struct TPool{
     T * fetch(){
-        if(cached.empty()){
+        T * x = try_fetch();
+        if(x == nullptr){
             // If there is no cached items, request `gen()` to produce one
-            return gen();
-        }else{
-            // Otherwise fetch directly from `cached`
-            return cached.back();
-            cached.pop_back();
+            x = gen();
+            stats.generated++;
         }
+        return x;
+    }
+    // Return `nullptr` rather than generating one when there is no cached object
+    T * try_fetch(){
+        if(cached.empty() && depot != nullptr){
+            depot->take(cached, std::max(low_watermark, (size_t)1));
+        }
+        if(cached.empty()){
+            stats.misses++;
+            return nullptr;
+        }
+        // Otherwise fetch directly from `cached`
+        T * x = cached.back();
+        cached.pop_back();
+        stats.hits++;
+        return x;
     }
     void release(T * x){
+        stats.released++;
         cached.push_back(x);
+        if(cached.size() > high_watermark){
+            trim(low_watermark);
+        }
+    }
+    void trim(size_t remain){
+        if(cached.size() <= remain){
+            return;
+        }
+        size_t n = cached.size() - remain;
+        if(depot != nullptr){
+            n -= depot->put(cached, n);
+        }
+        while(n > 0){
+            destroy(cached.back());
+            cached.pop_back();
+            stats.destroyed++;
+            n--;
+        }
     }
-    TPool(std::function<T*()> generator) : gen(generator){
+    size_t size() const{
+        return cached.size();
+    }
+    TPool(std::function<T*()> generator, std::function<void(T*)> destroyer = [](T * x){ delete x; }
+        , size_t high = 64, size_t low = 32, TPoolDepot<T> * _depot = nullptr) 
+        : gen(generator), destroy(destroyer), high_watermark(high), low_watermark(low), depot(_depot){
 
     }
     ~TPool(){
-        for(T * x : cached){
-            delete x;
-            x = nullptr;
-        }
+        // Objects cached by an exiting thread can still be used by other threads
+        trim(0);
     }
+
+    struct Stats{
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t generated = 0;
+        size_t released = 0;
+        size_t destroyed = 0;
+    } stats;
 protected:
     std::vector<T *> cached;
     std::function<T*()> gen;
+    std::function<void(T*)> destroy;
+    size_t high_watermark;
+    size_t low_watermark;
+    TPoolDepot<T> * depot;
+};
+
+// An open-addressing hash table from `uint64_t` to a pointer, which never allocates on lookup.
+// Collisions are resolved by linear probing, and erasing uses backward shifting,
+// so there are no tombstones and a probe always stops at the first empty slot.
+// `nullptr` is reserved to mark an empty slot, so it can't be stored as a value.
+template<typename T>
+struct TFlatMap{
+    typedef uint64_t key_type;
+    typedef T * mapped_type;
+
+    TFlatMap(size_t init_capacity = 16){
+        size_t cap = 16;
+        while(cap < init_capacity){
+            cap <<= 1;
+        }
+        keys.assign(cap, 0);
+        values.assign(cap, nullptr);
+    }
+    // Returns `nullptr` if `key` is not found
+    T * find(key_type key) const{
+        size_t mask = values.size() - 1;
+        for(size_t i = hash(key) & mask; values[i] != nullptr; i = (i + 1) & mask){
+            if(keys[i] == key){
+                return values[i];
+            }
+        }
+        return nullptr;
+    }
+    // Insert `value` or overwrite the old one with the same `key`
+    void insert(key_type key, T * value){
+        assert(value != nullptr);
+        // Keep load factor under 1/2, so probes are short
+        if((count + 1) * 2 > values.size()){
+            rehash(values.size() * 2);
+        }
+        size_t mask = values.size() - 1;
+        size_t i = hash(key) & mask;
+        for(; values[i] != nullptr; i = (i + 1) & mask){
+            if(keys[i] == key){
+                values[i] = value;
+                return;
+            }
+        }
+        keys[i] = key;
+        values[i] = value;
+        count++;
+    }
+    // Returns whether `key` is found and erased
+    bool erase(key_type key){
+        size_t mask = values.size() - 1;
+        size_t i = hash(key) & mask;
+        for(; values[i] != nullptr; i = (i + 1) & mask){
+            if(keys[i] == key){
+                break;
+            }
+        }
+        if(values[i] == nullptr){
+            return false;
+        }
+        // Shift back the following entries of this cluster,
+        // if the hole lies between their home slot and where they are now.
+        size_t j = i;
+        while(true){
+            j = (j + 1) & mask;
+            if(values[j] == nullptr){
+                break;
+            }
+            size_t home = hash(keys[j]) & mask;
+            if(((j - home) & mask) >= ((j - i) & mask)){
+                keys[i] = keys[j];
+                values[i] = values[j];
+                i = j;
+            }
+        }
+        keys[i] = 0;
+        values[i] = nullptr;
+        count--;
+        return true;
+    }
+    void clear(){
+        std::fill(keys.begin(), keys.end(), 0);
+        std::fill(values.begin(), values.end(), nullptr);
+        count = 0;
+    }
+    size_t size() const{
+        return count;
+    }
+    bool empty() const{
+        return count == 0;
+    }
+    template<typename F>
+    void for_each(F f) const{
+        for(size_t i = 0; i < values.size(); i++){
+            if(values[i] != nullptr){
+                f(keys[i], values[i]);
+            }
+        }
+    }
+protected:
+    static size_t hash(key_type key){
+        // Fibonacci hashing, mixing the high bits into the low ones which are used by the mask
+        key ^= key >> 29;
+        key *= 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(key ^ (key >> 32));
+    }
+    void rehash(size_t new_capacity){
+        std::vector<key_type> old_keys;
+        std::vector<T *> old_values;
+        old_keys.swap(keys);
+        old_values.swap(values);
+        keys.assign(new_capacity, 0);
+        values.assign(new_capacity, nullptr);
+        count = 0;
+        for(size_t i = 0; i < old_values.size(); i++){
+            if(old_values[i] != nullptr){
+                insert(old_keys[i], old_values[i]);
+            }
+        }
+    }
+    std::vector<key_type> keys;
+    std::vector<T *> values;
+    size_t count = 0;
+};
+
+// A slot map which holds pointers densely, so iterating is as fast as a `std::vector`.
+// `insert` returns a handle made of a slot index and the slot's generation,
+// the generation is increased when the slot is erased, so a stale handle can always be told apart.
+// Erasing is O(1) by moving the last item into the hole, so the order of items is not kept.
+template<typename T>
+struct TSlotMap{
+    typedef uint64_t handle_type;
+    typedef typename std::vector<T *>::iterator iterator;
+    typedef typename std::vector<T *>::const_iterator const_iterator;
+
+    // Handle 0 is never returned
+    handle_type insert(T * x){
+        uint32_t index;
+        if(free_head != npos){
+            index = free_head;
+            free_head = slots[index].pos;
+        } else{
+            index = static_cast<uint32_t>(slots.size());
+            slots.push_back(Slot{1, npos});
+        }
+        slots[index].pos = static_cast<uint32_t>(dense.size());
+        dense.push_back(x);
+        dense_slot.push_back(index);
+        return make_handle(index, slots[index].generation);
+    }
+    // Returns `nullptr` if `h` is erased or invalid
+    T * get(handle_type h) const{
+        uint32_t index = static_cast<uint32_t>(h);
+        if(!valid(h)){
+            return nullptr;
+        }
+        return dense[slots[index].pos];
+    }
+    bool valid(handle_type h) const{
+        uint32_t index = static_cast<uint32_t>(h);
+        uint32_t generation = static_cast<uint32_t>(h >> 32);
+        return index < slots.size() && slots[index].generation == generation && generation != 0;
+    }
+    // Returns whether `h` is valid and erased
+    bool erase(handle_type h){
+        if(!valid(h)){
+            return false;
+        }
+        uint32_t index = static_cast<uint32_t>(h);
+        uint32_t pos = slots[index].pos;
+        // Move the last item to the hole
+        dense[pos] = dense.back();
+        dense_slot[pos] = dense_slot.back();
+        slots[dense_slot[pos]].pos = pos;
+        dense.pop_back();
+        dense_slot.pop_back();
+        // Outdate all handles to this slot, generation 0 is skipped because handle 0 is reserved
+        slots[index].generation++;
+        if(slots[index].generation == 0){
+            slots[index].generation = 1;
+        }
+        slots[index].pos = free_head;
+        free_head = index;
+        return true;
+    }
+    void clear(){
+        // Keep generations, so handles issued before are still invalid
+        free_head = npos;
+        for(uint32_t index : dense_slot){
+            slots[index].generation++;
+            if(slots[index].generation == 0){
+                slots[index].generation = 1;
+            }
+        }
+        for(uint32_t i = static_cast<uint32_t>(slots.size()); i > 0; i--){
+            slots[i - 1].pos = free_head;
+            free_head = i - 1;
+        }
+        dense.clear();
+        dense_slot.clear();
+    }
+    T * operator[](size_t i) const{
+        return dense[i];
+    }
+    size_t size() const{
+        return dense.size();
+    }
+    bool empty() const{
+        return dense.empty();
+    }
+    iterator begin(){ return dense.begin(); }
+    iterator end(){ return dense.end(); }
+    const_iterator begin() const{ return dense.begin(); }
+    const_iterator end() const{ return dense.end(); }
+
+protected:
+    static constexpr uint32_t npos = UINT32_MAX;
+    static handle_type make_handle(uint32_t index, uint32_t generation){
+        return (static_cast<handle_type>(generation) << 32) | index;
+    }
+    struct Slot{
+        uint32_t generation;
+        // Position in `dense` when the slot is in use, otherwise next free slot
+        uint32_t pos;
+    };
+    std::vector<Slot> slots;
+    std::vector<T *> dense;
+    // Which slot each item in `dense` belongs to
+    std::vector<uint32_t> dense_slot;
+    uint32_t free_head = npos;
 };
 
 #ifdef _ATP_LOG_TBUF
@@ -97,9 +426,11 @@ struct TBuffer{
         }
         Iterator & operator++(){
             index++;
+            return *this;
         }
         Iterator & operator--(){
             index--;
+            return *this;
         }
         reference operator*(){
             return tbuf->at(index);
@@ -125,9 +456,18 @@ struct TBuffer{
     typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
     iterator begin(){
+        // After `init()`, `oldest_index` is `UINT_MAX`, which would never reach `end()`
+        if (newest_index < oldest_index)
+        {
+            return end();
+        }
         return iterator(this, oldest_index);
     }
     const_iterator begin() const{
+        if (newest_index < oldest_index)
+        {
+            return end();
+        }
         return iterator(this, oldest_index);
     }
 
@@ -202,6 +542,15 @@ struct TBuffer{
         data[pos] = nullptr;
         valid_size--;
     }
+    void erase(size_t index){
+        // Clear an element in the middle, which `front`/`back` skip later
+        reference item = at(index);
+        if (item != nullptr)
+        {
+            item = nullptr;
+            valid_size--;
+        }
+    }
     reference at(size_t index){
         size_t pos = get_pos(index);
         return data[pos];
@@ -263,6 +612,8 @@ struct TBuffer{
             _log_tbuf("Move [%u]-th element old[%u] to new[%u]\n", index, get_pos(index), i);
         }
         capacity = new_capacity;
+        // Elements are re-located from `data[0]`, which now holds `oldest_index`
+        pivot = oldest_index;
         delete [] data;
         data = newdata;
     }
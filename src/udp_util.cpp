@@ -57,4 +57,69 @@ inline int make_socket(int family, int type, int protocol) {
         err_sys("socket error");
 
     return sockfd;
-}
\ No newline at end of file
+}
+bool enable_reuse_port(int sockfd){
+    int on = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == 0;
+}
+
+bool enable_zerocopy(int sockfd){
+    int on = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) == 0;
+}
+
+bool zerocopy_enabled(int sockfd){
+    int on = 0;
+    socklen_t len = sizeof on;
+    return getsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, &len) == 0 && on != 0;
+}
+
+bool enable_udp_gro(int sockfd){
+    int on = 1;
+    return setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof on) == 0;
+}
+
+size_t gro_segment_size(const struct msghdr * hdr){
+    if (hdr->msg_controllen == 0)
+    {
+        return 0;
+    }
+    // `CMSG_NXTHDR` takes a non-const header
+    struct msghdr * h = const_cast<struct msghdr *>(hdr);
+    for (struct cmsghdr * cm = CMSG_FIRSTHDR(h); cm != nullptr; cm = CMSG_NXTHDR(h, cm))
+    {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+        {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof gso_size);
+            return gso_size > 0 ? static_cast<size_t>(gso_size) : 0;
+        }
+    }
+    return 0;
+}
+
+ssize_t recvfrom_gro(int sockfd, char * buf, size_t len, int flags, SA * addr, socklen_t * addr_len, size_t * segment_size){
+    char control[ATP_GRO_CONTROL_SIZE];
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.msg_name = addr;
+    hdr.msg_namelen = addr_len == nullptr ? 0 : *addr_len;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof control;
+    ssize_t n = recvmsg(sockfd, &hdr, flags);
+    if (n < 0)
+    {
+        return n;
+    }
+    if (addr_len != nullptr)
+    {
+        *addr_len = hdr.msg_namelen;
+    }
+    *segment_size = gro_segment_size(&hdr);
+    return n;
+}
@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h> // sockaddr
 #include <arpa/inet.h> // inet_ functions
+#include <netinet/udp.h> // UDP_SEGMENT, UDP_GRO
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
@@ -36,6 +37,23 @@
 
 #define SA struct sockaddr
 
+// Not defined by older glibc headers
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
 typedef void sigfunc_t(int);
 
 sigfunc_t * setup_signal(int signo, sigfunc_t * func);
@@ -45,6 +63,21 @@ struct sockaddr_in make_socketaddr_in(int family, const char * ipaddr_str, int p
 
 ATP_PROC_RESULT normal_sendto(atp_callback_arguments * args);
 
+// Allow other fds to bind the port of `sockfd`, which must not be bound yet
+bool enable_reuse_port(int sockfd);
+// Allow `MSG_ZEROCOPY` on `sockfd`, returns false if SO_ZEROCOPY is not supported
+bool enable_zerocopy(int sockfd);
+bool zerocopy_enabled(int sockfd);
+// Let the kernel coalesce datagrams of a flow on `sockfd`, returns false if UDP_GRO is not supported.
+// Once enabled, `sockfd` must be read by `recvfrom_gro`, or the segments can't be split again.
+bool enable_udp_gro(int sockfd);
+// Control buffer space `recvmsg` needs for the UDP_GRO cmsg
+#define ATP_GRO_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+// Segment size from the UDP_GRO cmsg of `hdr`, 0 if the datagram is not coalesced
+size_t gro_segment_size(const struct msghdr * hdr);
+// Like `recvfrom`, `segment_size` is set to the size of the coalesced datagrams, or 0
+ssize_t recvfrom_gro(int sockfd, char * buf, size_t len, int flags, SA * addr, socklen_t * addr_len, size_t * segment_size);
+
 inline void activate_nonblock(int fd)
 {
     int flags = fcntl(fd, F_GETFL);
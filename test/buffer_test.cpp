@@ -91,9 +91,121 @@ bool test(const std::vector<int> & vec, int offset){
 
 
 }
+bool test_sliding(){
+    // Like `outbuf`, pop from the front and put at the rear, so it grows after the front has moved
+    TBuffer<int> buf;
+    std::vector<int> values(64);
+    bool ok = true;
+    for(int i = 0; i < 4; i++){
+        buf.put(1000 + i, &values[i]);
+    }
+    buf.pop_front();
+    buf.pop_front();
+    for(int i = 4; i < 40; i++){
+        buf.put(1000 + i, &values[i]);
+    }
+    // Elements in the middle are erased like SACKed packets
+    for(int i = 10; i < 20; i++){
+        buf.erase(1000 + i);
+    }
+    ok = ok && buf.size() == 28;
+    for(int i = 2; i < 40; i++){
+        ok = ok && buf.at(1000 + i) == ((i >= 10 && i < 20) ? nullptr : &values[i]);
+    }
+    size_t popped = 0;
+    while(!buf.empty()){
+        buf.pop_front();
+        popped++;
+    }
+    ok = ok && popped == 28;
+    printf("Sliding TBuffer test %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+bool test_pool(){
+    int generated = 0, destroyed = 0;
+    TPoolDepot<int> depot(4, [&](int * x){ destroyed++; delete x; });
+    bool ok = true;
+    {
+        TPool<int> pool([&](){ generated++; return new int(0); }, [&](int * x){ destroyed++; delete x; }, 4, 2, &depot);
+        std::vector<int *> items;
+        for(int i = 0; i < 8; i++){
+            items.push_back(pool.fetch());
+        }
+        // Fetched items must be distinct
+        std::sort(items.begin(), items.end());
+        ok = ok && std::unique(items.begin(), items.end()) == items.end();
+        for(int * x : items){
+            pool.release(x);
+        }
+        // Shrinked to low watermark, overflowed items go to depot, and the rest are destroyed
+        printf("Pool size %u, depot size %u, destroyed %d\n", pool.size(), depot.size(), destroyed);
+        ok = ok && pool.size() <= 4 && depot.size() == 4 && destroyed + pool.size() + depot.size() == 8;
+        // Recycled
+        int * x = pool.fetch();
+        ok = ok && generated == 8;
+        pool.release(x);
+    }
+    printf("Pool test %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+bool test_flatmap(){
+    TFlatMap<int> table;
+    std::map<uint64_t, int *> ref;
+    std::vector<int> values(2000);
+    bool ok = true;
+    std::srand(1);
+    for(int round = 0; round < 20000; round++){
+        // Keys are drawn from a small range so there are plenty of collisions and deletes
+        uint64_t key = (static_cast<uint64_t>(std::rand() % 2000) << 32) | (std::rand() % 4);
+        if(std::rand() % 3 == 0){
+            ok = ok && (table.erase(key) == (ref.erase(key) == 1));
+        } else{
+            int * v = &values[std::rand() % values.size()];
+            table.insert(key, v);
+            ref[key] = v;
+        }
+    }
+    ok = ok && table.size() == ref.size();
+    for(auto & pr : ref){
+        ok = ok && table.find(pr.first) == pr.second;
+    }
+    printf("FlatMap size %u, test %s\n", table.size(), ok ? "passed" : "failed");
+    return ok;
+}
+
+bool test_slotmap(){
+    TSlotMap<int> table;
+    std::vector<int> values(100);
+    std::vector<uint64_t> handles;
+    bool ok = true;
+    for(int & v : values){
+        handles.push_back(table.insert(&v));
+    }
+    // Erase every odd one, the rest must still be found by their handles
+    for(size_t i = 1; i < handles.size(); i += 2){
+        ok = ok && table.erase(handles[i]);
+    }
+    for(size_t i = 0; i < handles.size(); i++){
+        ok = ok && table.get(handles[i]) == (i % 2 == 0 ? &values[i] : nullptr);
+    }
+    // Reusing a slot must not revive stale handles
+    uint64_t h = table.insert(&values[1]);
+    ok = ok && table.get(h) == &values[1] && table.get(handles[1]) == nullptr && !table.erase(handles[1]);
+    ok = ok && table.size() == 51 && table.get(0) == nullptr;
+    printf("SlotMap size %u, test %s\n", table.size(), ok ? "passed" : "failed");
+    return ok;
+}
+
 int main(int argc, char* argv[], char* env[]){
+    bool ok = true;
+    ok = test_pool() && ok;
+    ok = test_flatmap() && ok;
+    ok = test_slotmap() && ok;
+    ok = test_sliding() && ok;
     test({1,2,3}, 100);
     test({1,2,3,4,5,6,7,8,9,10}, 200);
     test({6,7,10,1,9,8,2,3,4,5}, 200);
-    return 0;
+    return ok ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,93 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "atp.h"
+#include "test.inc.h"
+#include <ctime>
+#include <vector>
+#include <sys/resource.h>
+
+// Create `n` sockets, each with its own fd, destroy them all at once, and time the context tearing them down.
+// Destroying a socket costs O(1), so 4 times more sockets must not cost much more than 4 times longer.
+
+static uint64_t wall_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t run(size_t n){
+    atp_context * context = atp_create_context();
+    std::vector<atp_socket *> sockets;
+    std::vector<int> sockfds;
+    for(size_t i = 0; i < n; i++){
+        sockets.push_back(atp_create_socket(context));
+        sockfds.push_back(atp_getfd(sockets.back()));
+    }
+    for(atp_socket * socket : sockets){
+        socket->destroy_hard();
+    }
+    uint64_t start = wall_us();
+    atp_timer_event(context, 0);
+    uint64_t cost = wall_us() - start;
+    printf("Destroyed %zu sockets in %llu us, %zu left\n", n, (unsigned long long)cost, context->sockets.size());
+    delete context;
+    // Users close the fds they created
+    for(int sockfd : sockfds){
+        close(sockfd);
+    }
+    return cost;
+}
+
+int main(int argc, char* argv[], char* env[]){
+    int oc;
+    size_t total = 16 * 1024;
+    while((oc = getopt(argc, argv, "n:")) != -1)
+    {
+        switch(oc)
+        {
+        case 'n':
+            sscanf(optarg, "%zu", &total);
+            break;
+        }
+    }
+    // Every socket holds a fd
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < total + 64)
+        {
+            total = limit.rlim_cur - 64;
+        }
+    }
+    // Warm up pools and the page cache of the allocator, then take the best of several runs
+    run(total / 4);
+    uint64_t small = UINT64_MAX, large = UINT64_MAX;
+    for(int i = 0; i < 3; i++){
+        small = std::min(small, run(total / 4));
+        large = std::min(large, run(total));
+    }
+    // Linear teardown is about 4 times longer, a scan of the remaining sockets makes it about 16 times
+    bool ok = large <= 8 * std::max<uint64_t>(small, 1000);
+    printf("Close bench %s\n", ok ? "passed" : "failed");
+    return ok ? 0 : 1;
+}
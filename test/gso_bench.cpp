@@ -0,0 +1,172 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "atp.h"
+#include "udp_util.h"
+#include "test.inc.h"
+#include <ctime>
+#include <poll.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Send `total` bytes through loopback within one process, without UDP GSO, with GSO, and with both GSO and GRO,
+// and compare the CPU cost.
+// Packets are logged when ATP is built with ATP_LOG_AT_NOTE, so redirect stdout: `./bin/gso_bench > /dev/null`
+
+static size_t received = 0;
+static uint64_t recv_calls = 0;
+
+static ATP_PROC_RESULT count_arrived(atp_callback_arguments * args){
+    received += args->length;
+    return ATP_PROC_OK;
+}
+
+static uint64_t cpu_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void drain(atp_context * context, int sockfd, char * msg, bool & got){
+    struct sockaddr_in addr; socklen_t addr_len = sizeof addr;
+    ssize_t n;
+    size_t segment_size;
+    // `recvfrom_gro` also works when GRO is not enabled, in which case `segment_size` is 0
+    while((n = recvfrom_gro(sockfd, msg, ATP_GRO_CACHE_MAX, 0, (SA *)&addr, &addr_len, &segment_size)) >= 0){
+        atp_process_udp_gro(context, sockfd, msg, n, segment_size, (const SA *)&addr, addr_len);
+        addr_len = sizeof addr;
+        recv_calls++;
+        got = true;
+    }
+}
+
+static bool run(bool gso, bool gro, uint16_t port, size_t total, size_t chunk){
+    received = 0;
+    recv_calls = 0;
+    atp_context * context = atp_create_context();
+
+    atp_socket * recv_socket = atp_create_socket(context);
+    int recv_fd = atp_getfd(recv_socket);
+    atp_set_callback(recv_socket, ATP_CALL_ON_RECV, count_arrived);
+    // ACK every packet, so the sender is not paced by delayed ACKs
+    atp_set_long(recv_socket, ATP_API_ACK_DELAYED_US, 0);
+    struct sockaddr_in srv_addr = make_socketaddr_in(AF_INET, "127.0.0.1", port);
+    if (bind(recv_fd, (SA *) &srv_addr, sizeof srv_addr) < 0)
+        err_sys("bind error");
+    atp_listen(recv_socket, port);
+    atp_set_long(recv_socket, ATP_API_GRO, gro);
+
+    atp_socket * send_socket = atp_create_socket(context);
+    int send_fd = atp_getfd(send_socket);
+    atp_set_long(send_socket, ATP_API_GSO, gso);
+    atp_async_connect(send_socket, (const SA *)&srv_addr, sizeof srv_addr);
+    activate_nonblock(recv_fd);
+    activate_nonblock(send_fd);
+
+    std::vector<char> data(chunk, 'a');
+    char * msg = new char[ATP_GRO_CACHE_MAX];
+    size_t written = 0;
+    uint64_t start_ms = get_current_ms();
+    ATPTxQueue & queue = tx_queue();
+    uint64_t datagrams = queue.sendmmsg_datagrams, gso_sends = queue.gso_sends;
+    uint64_t start_ns = cpu_ns(), start_cycles = cycles();
+    while(received < total){
+        if (get_current_ms() - start_ms > 60000)
+        {
+            fprintf(stderr, "Timeout, %zu of %zu bytes received.\n", received, total);
+            break;
+        }
+        if (written < total && atp_get_long(send_socket, ATP_API_STATUS) == CS_CONNECTED && atp_get_long(send_socket, ATP_API_WRITABLE))
+        {
+            atp_result r = atp_async_write(send_socket, data.data(), std::min(chunk, total - written));
+            if (r > 0)
+            {
+                written += r;
+            }
+        }
+        bool got = false;
+        drain(context, send_fd, msg, got);
+        drain(context, recv_fd, msg, got);
+        if (!got)
+        {
+            // Sleep rather than spin, so only the work is counted in CPU time
+            struct pollfd pfd[2] = {{send_fd, POLLIN, 0}, {recv_fd, POLLIN, 0}};
+            int wait_ms = atp_next_timeout(context);
+            if (wait_ms < 0 || wait_ms > 100)
+            {
+                wait_ms = 100;
+            }
+            if (poll(pfd, 2, wait_ms) == 0)
+            {
+                atp_timer_event(context, 0);
+            }
+        }
+    }
+    uint64_t used_ns = cpu_ns() - start_ns, used_cycles = cycles() - start_cycles;
+    const char * name = gro ? "GSO+GRO" : (gso ? "GSO    " : "No GSO ");
+    fprintf(stderr, "%s: %zu bytes, cpu %.3f ms, %.3f bytes/cpu-ns", name, received, used_ns / 1e6, 1.0 * received / used_ns);
+    if (used_cycles > 0)
+    {
+        fprintf(stderr, ", %.3f bytes/cycle", 1.0 * received / used_cycles);
+    }
+    fprintf(stderr, ", %llu datagrams, %llu GSO sends%s, %llu recvs%s\n", (unsigned long long)(queue.sendmmsg_datagrams - datagrams)
+        , (unsigned long long)(queue.gso_sends - gso_sends), queue.gso_supported ? "" : "(not supported)"
+        , (unsigned long long)recv_calls, (gro && !atp_get_long(recv_socket, ATP_API_GRO)) ? "(GRO not supported)" : "");
+    delete [] msg;
+    close(recv_fd);
+    close(send_fd);
+    delete context;
+    return received >= total;
+}
+
+int main(int argc, char* argv[], char* env[]){
+    int oc;
+    uint16_t port = 9877;
+    size_t total = 16 * 1024 * 1024;
+    size_t chunk = 64 * 1024;
+    while((oc = getopt(argc, argv, "p:n:c:")) != -1)
+    {
+        switch(oc)
+        {
+        case 'p':
+            sscanf(optarg, "%hu", &port);
+            break;
+        case 'n':
+            sscanf(optarg, "%zu", &total);
+            break;
+        case 'c':
+            sscanf(optarg, "%zu", &chunk);
+            break;
+        }
+    }
+    bool ok = run(false, false, port, total, chunk);
+    ok = run(true, false, port + 1, total, chunk) && ok;
+    ok = run(true, true, port + 2, total, chunk) && ok;
+    return ok ? 0 : 1;
+}
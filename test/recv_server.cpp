@@ -32,9 +32,10 @@ int main(int argc, char* argv[], char* env[]){
     struct sockaddr_in srv_addr;
 
     bool simulate_packet = false;
+    int backend = ATP_SERVER_BACKEND_EPOLL;
     int oc;
 
-    while((oc = getopt(argc, argv, "p:s")) != -1)
+    while((oc = getopt(argc, argv, "p:su")) != -1)
     {
         switch(oc)
         {
@@ -44,12 +45,15 @@ int main(int argc, char* argv[], char* env[]){
         case 's':
             simulate_packet = true;
             break;
+        case 'u':
+            backend = ATP_SERVER_BACKEND_IO_URING;
+            break;
         }
     }
 
 
     reg_sigterm_handler(sigterm_handler);
-    atp_context * context = atp_create_context_server();
+    atp_context * context = atp_create_context_server_backend(backend);
     atp_start_server(context);
 
     atp_socket * socket = atp_create_blocked_socket(context);
@@ -84,5 +88,8 @@ int main(int argc, char* argv[], char* env[]){
     }
 
     atp_wait_server(context);
+    fprintf(stderr, "%s: %zu syscalls, %zu packets received\n"
+        , atp_server_get_long(context, ATP_SERVER_API_BACKEND) == ATP_SERVER_BACKEND_IO_URING ? "io_uring" : "epoll"
+        , atp_server_get_long(context, ATP_SERVER_API_SYSCALLS), atp_server_get_long(context, ATP_SERVER_API_RECV_PACKETS));
     puts("Quit.");
 }
\ No newline at end of file
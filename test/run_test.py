@@ -212,6 +212,39 @@ def test_server():
     wait_procs(procs, 10.0)
     t.join()
 
+def test_shard_server():
+    print "-- test shard server"
+    # Listeners keep listening, so every shard accepts connections one after another.
+    # With -D, accepted connections receive from their own connected fds
+    for (shards, dedicated) in [(1, False), (2, False), (1, True), (2, True)]:
+        args = ["./bin/shard_server", "-n%d" % shards, "-t20"] + (["-D"] if dedicated else [])
+        r = (args, None, open("r.log", "w"), open("r1.log", "w"))
+        procs = start_procs([r], True)
+        senders = []
+        for i in range(4 * shards):
+            s = (["./bin/send_server"], subprocess.PIPE, open("s_%d.log" % i, "w"), open("s1_%d.log" % i, "w"))
+            sender = start_procs([s], True)[0]
+            time.sleep(0.5) # wait till connection is established
+            sender.stdin.write("message_from_sender_%d\n" % i)
+            sender.stdin.close()
+            senders.append(sender)
+        wait_procs(senders, 15.0)
+        wait_procs(procs, 20.0)
+        received = len([line for line in open("r.log") if "data: message_from_sender_" in line])
+        print "%d shards received %d of %d messages" % (shards, received, 4 * shards)
+        if received != 4 * shards:
+            print "Shard server lost messages"
+            sys.exit(1)
+        if dedicated and len([line for line in open("r.log") if "shares fd" in line]) > 0:
+            print "Connections share fds with listeners"
+            sys.exit(1)
+
+
+def test_close():
+    print "-- test mass close"
+    if subprocess.call(["./bin/close_bench"], stdout = open("s.log", "w")) != 0:
+        print "Destroying sockets is not linear"
+        sys.exit(1)
 
 def test_rep():
     print "--test repeat"
@@ -257,6 +290,10 @@ def main():
 
     test_server()
 
+    test_shard_server()
+
+    test_close()
+
     test_rep()
 
     test_reorder()
@@ -21,19 +21,38 @@
 #include "udp_util.h"
 #include "test.inc.h"
 #include <unistd.h>
+#include <vector>
+
+static size_t zc_completed = 0;
+
+ATP_PROC_RESULT on_send_complete(atp_callback_arguments * args){
+    if (args->error_code == ATP_PROC_OK)
+    {
+        zc_completed += args->length;
+    }
+    return ATP_PROC_OK;
+}
 
 int main(int argc, char* argv[], char* env[]){
     int oc;
     bool simulate_loss = false;
     bool simulate_delay = false;
+    bool zero_copy = false;
     uint16_t serv_port = 9876;
     uint16_t cli_port = 0;
     char input_file_name[255] = "in.dat";
     uint16_t sock_id = 0;
-    while((oc = getopt(argc, argv, "i:l:p:s:P:d:")) != -1)
+    size_t zerocopy_min = 0;
+    while((oc = getopt(argc, argv, "i:l:p:s:P:d:zZ:")) != -1)
     {
         switch(oc)
         {
+        case 'Z':
+            sscanf(optarg, "%zu", &zerocopy_min);
+            break;
+        case 'z':
+            zero_copy = true;
+            break;
         case 'd':
             sscanf(optarg, "%u", &delay_time);
             simulate_delay = true;
@@ -65,6 +84,11 @@ int main(int argc, char* argv[], char* env[]){
     atp_context * context = atp_create_context();
     atp_socket * socket = atp_create_socket(context);
     if(sock_id != 0){atp_set_long(socket, ATP_API_SOCKID, sock_id); }
+    if(zerocopy_min != 0){
+        // `-Z` sends packets of at least `zerocopy_min` bytes with MSG_ZEROCOPY
+        atp_set_long(socket, ATP_API_ZEROCOPY_MIN, zerocopy_min);
+        fprintf(stderr, "MSG_ZEROCOPY from %zu bytes\n", atp_get_long(socket, ATP_API_ZEROCOPY_MIN));
+    }
     int sockfd = atp_getfd(socket);
 
     if(cli_port != 0){
@@ -96,6 +120,16 @@ int main(int argc, char* argv[], char* env[]){
     // setsockopt(socket->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     FILE * fin = fopen(input_file_name, "rb");
     FileObject fin_obj {fin, ATP_MIN_BUFFER_SIZE};
+    // With `-z`, the whole file is loaded and sent by `atp_async_write_zc`
+    std::vector<char> zc_data;
+    size_t zc_written = 0;
+    if(zero_copy){
+        char chunk[4096]; size_t k;
+        while((k = fread(chunk, 1, sizeof chunk, fin)) > 0){
+            zc_data.insert(zc_data.end(), chunk, chunk + k);
+        }
+        atp_set_callback(socket, ATP_CALL_ON_SEND_COMPLETE, on_send_complete);
+    }
     while (true) {
         sockaddr * psock_addr = (SA *)&srv_addr;
         if ((n = recvfrom(sockfd, recv_msg, ATP_MAX_READ_BUFFER_SIZE, 0, psock_addr, &srv_len)) >= 0){
@@ -112,7 +146,28 @@ int main(int argc, char* argv[], char* env[]){
                 break;
             }
         }
-        if(!fin_obj.eof()){
+        if(zero_copy){
+            while(zc_written < zc_data.size()){
+                // Write by chunks, the same as `FileObject`
+                size_t buffer_sz = std::min(zc_data.size() - zc_written, ATP_MIN_BUFFER_SIZE);
+                atp_result r = atp_async_write_zc(socket, zc_data.data() + zc_written, buffer_sz);
+                if (r > 0)
+                {
+                    zc_written += r;
+                }
+                if (r != buffer_sz)
+                {
+                    break;
+                }
+            }
+            if(zc_written == zc_data.size() && zc_completed == zc_data.size()){
+                // all packets are ACKed, and the memory can be released
+                puts("Trans Finished");
+                if(zerocopy_min != 0){ fprintf(stderr, "Zero-copy buffers pending %zu\n", atp_get_long(socket, ATP_API_ZEROCOPY_PENDING)); }
+                atp_standalone_close(socket);
+                break;
+            }
+        }else if(!fin_obj.eof()){
             while(!fin_obj.eof()){
                 size_t buffer_sz;
                 char * buffer = fin_obj.get(buffer_sz);
@@ -132,6 +187,7 @@ int main(int argc, char* argv[], char* env[]){
             {
                 // all packets are ACKed
                 puts("Trans Finished");
+                if(zerocopy_min != 0){ fprintf(stderr, "Zero-copy buffers pending %zu\n", atp_get_long(socket, ATP_API_ZEROCOPY_PENDING)); }
                 atp_standalone_close(socket);
                 break;
             }
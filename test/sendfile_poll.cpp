@@ -112,7 +112,13 @@ int main(int argc, char* argv[], char* env[]){
             break;
         }
 
-        int ret = poll(pfd, 3, 1000);
+        // Sleep until the next timeout of ATP, but wake up regularly to check stdin and file
+        int wait_ms = atp_next_timeout(context);
+        if (wait_ms < 0 || wait_ms > 1000)
+        {
+            wait_ms = 1000;
+        }
+        int ret = poll(pfd, 3, wait_ms);
         size_t n;
 
         if (ret < 0) {
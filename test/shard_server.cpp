@@ -0,0 +1,113 @@
+/*
+*   Calvin Neo
+*   Copyright (C) 2017  Calvin Neo <calvinneo@calvinneo.com>
+*   https://github.com/CalvinNeo/ATP
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program; if not, write to the Free Software Foundation, Inc.,
+*   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "atp_svc.h"
+#include "udp_util.h"
+#include "test.inc.h"
+#include <iostream>
+#include <cstdio>
+#include <thread>
+#include <chrono>
+
+// Every connection is printed with the shard handling it, which is also told by its sock_id
+atp_sharded_server * server = nullptr;
+bool dedicated_fd = false;
+
+size_t shard_of(atp_socket * socket){
+    return (atp_get_long(socket, ATP_API_SOCKID) & 0xff) % atp_sharded_server_size(server);
+}
+
+ATP_PROC_RESULT data_arrived(atp_callback_arguments * args){
+    atp_socket * socket = args->socket;
+    printf("shard %zu sock %zu fd %d data: %.*s\n", shard_of(socket), atp_get_long(socket, ATP_API_SOCKID), atp_getfd(socket)
+        , (int)args->length, args->data);
+    if (dedicated_fd)
+    {
+        // Every connection, the first one of a shard included, is forked and receives from its own fd
+        for(size_t i = 0; i < atp_sharded_server_size(server); i++){
+            if (atp_getfd(atp_sharded_server_listener(server, i)) == atp_getfd(socket))
+            {
+                printf("shard %zu sock %zu shares fd %d with a listener\n", shard_of(socket), atp_get_long(socket, ATP_API_SOCKID), atp_getfd(socket));
+            }
+        }
+    }
+    return ATP_PROC_OK;
+}
+
+ATP_PROC_RESULT on_fork(atp_callback_arguments * args){
+    args->socket = atp_fork_socket(args->socket);
+    atp_set_callback(args->socket, ATP_CALL_ON_RECV, data_arrived);
+    return ATP_PROC_OK;
+}
+
+int main(int argc, char* argv[], char* env[]){
+    uint16_t serv_port = 9876;
+    size_t shards = 4;
+    size_t seconds = 10;
+    int backend = ATP_SERVER_BACKEND_EPOLL;
+    int oc;
+
+    while((oc = getopt(argc, argv, "p:n:t:uD")) != -1)
+    {
+        switch(oc)
+        {
+        case 'p':
+            sscanf(optarg, "%hu", &serv_port);
+            break;
+        case 'n':
+            sscanf(optarg, "%zu", &shards);
+            break;
+        case 't':
+            sscanf(optarg, "%zu", &seconds);
+            break;
+        case 'u':
+            backend = ATP_SERVER_BACKEND_IO_URING;
+            break;
+        case 'D':
+            // Every connection gets its own fd
+            dedicated_fd = true;
+            break;
+        }
+    }
+
+    reg_sigterm_handler(sigterm_handler);
+    server = atp_create_sharded_server(shards, backend);
+    if(atp_sharded_listen(server, serv_port) != ATP_PROC_OK){
+        err_sys("bind error");
+    }
+    for(size_t i = 0; i < atp_sharded_server_size(server); i++){
+        atp_socket * listener = atp_sharded_server_listener(server, i);
+        atp_set_callback(listener, ATP_CALL_ON_RECV, data_arrived);
+        atp_set_callback(listener, ATP_CALL_ON_FORK, on_fork);
+        atp_set_long(listener, ATP_API_DEDICATED_FD, dedicated_fd);
+    }
+    fprintf(stderr, "%zu shards, steered by %s\n", atp_sharded_server_size(server)
+        , atp_sharded_server_steered(server) ? "sock_id" : "address hash");
+    atp_start_sharded_server(server);
+
+    // Listeners keep listening, so the server never finishes by itself
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    for(size_t i = 0; i < atp_sharded_server_size(server); i++){
+        atp_context * context = atp_sharded_server_context(server, i);
+        fprintf(stderr, "shard %zu: %zu packets received\n", i, atp_server_get_long(context, ATP_SERVER_API_RECV_PACKETS));
+    }
+    puts("Quit.");
+    fflush(stdout);
+    _exit(0);
+}
@@ -67,31 +67,26 @@ inline ATP_PROC_RESULT simulate_packet_loss_sendto(atp_callback_arguments * args
 }
 
 inline ATP_PROC_RESULT simulate_delayed_sendto(atp_callback_arguments * args){
-    char * data = new char[args->length];
-    std::memcpy(data, args->data, args->length);
-    char * addr = new char[args->addr_len];
-    std::memcpy(addr, args->addr, args->addr_len);
-
-    // create a copy of arguments
-    atp_callback_arguments * new_arg = new atp_callback_arguments(*args);
-    new_arg->data = data;
-    new_arg->addr = (const SA *)addr;
+    // Hold the datagram rather than copying it, it remains valid even if it is ACKed before sent
+    atp_buffer * buffer = atp_buffer_retain(args);
+    atp_callback_arguments new_arg = *args;
 
     // std::atomic_thread_fence(std::memory_order_seq_cst);
-    std::thread send_thread{[=](){
+    std::thread send_thread{[=]() mutable{
         // printf("sleep at %llu\n", get_current_ms());
         #if defined(ATP_LOG_UDP) && defined(ATP_LOG_AT_DEBUG)
-            log_debug(new_arg->socket, "UDP delay a packet for %u ms.", delay_time);
+            log_debug(new_arg.socket, "UDP delay a packet for %u ms.", delay_time);
         #endif
         std::this_thread::sleep_for(std::chrono::milliseconds(delay_time));
         // printf("wake and send at %llu\n", get_current_ms());
         #if defined(ATP_LOG_UDP) && defined(ATP_LOG_AT_DEBUG)
-            log_debug(new_arg->socket, "UDP sent delayed packet.");
+            log_debug(new_arg.socket, "UDP sent delayed packet.");
         #endif
-        normal_sendto(new_arg);
-        delete [] new_arg->data;
-        delete [] new_arg->addr;
-        delete new_arg;
+        new_arg.data = atp_buffer_data(buffer);
+        new_arg.length = atp_buffer_length(buffer);
+        new_arg.addr = atp_buffer_addr(buffer);
+        normal_sendto(&new_arg);
+        atp_buffer_release(buffer);
     }};
     // std::atomic_thread_fence(std::memory_order_seq_cst);
     if (send_thread.joinable()) {
@@ -327,5 +322,5 @@ FINISH:
         printf("Sent a simulated packet. seq_nr:%u, ack_nr:%u, flag:%s, payload:%u, peer_sock_id:%u, port:%u, src_port:%u\n",
          out_pkt->get_head()->seq_nr, out_pkt->get_head()->ack_nr, OutgoingPacket::get_flags_str(out_pkt).c_str(), out_pkt->payload, out_pkt->get_head()->peer_sock_id, port, src_port);
     }
-    delete out_pkt;
+    socket->context->packet_arena.release(out_pkt);
 }
\ No newline at end of file